@@ -20,8 +20,7 @@ std::unique_ptr<QMainWindow> setupUi()
   {
     QStringList valid_tags = {"wow", "such", "tags"};
     tag_edit->setTagsForCompletion(valid_tags);
-    tag_edit->setTagFilter(
-        [valid_tags](const QString& tag) { return valid_tags.contains(tag); });
+    tag_edit->setValidTags({valid_tags.begin(), valid_tags.end()});
     layout->addRow("Tags", tag_edit);
   }
 
@@ -32,6 +31,7 @@ std::unique_ptr<QMainWindow> setupUi()
       return valid_properties.contains(tag);
     });
     property_edit->setPropertySeparator('=');
+    property_edit->setValuesForCompletion("box", {"small", "medium", "large"});
     layout->addRow("Properties", property_edit);
   }
 
@@ -39,11 +39,12 @@ std::unique_ptr<QMainWindow> setupUi()
     layout->addRow("Line edit", line_edit);
     QObject::connect(property_edit, &QTagEdit::tagsChanged,
                      [property_edit, line_edit]() {
-                       auto properties = property_edit->getProperties();
                        QString text{};
-                       for (const auto& prop : properties) {
-                         text.append(prop.name + ", ");
-                       }
+                       property_edit->forEachProperty(
+                           [&text](const QTagEdit::PropertyView& prop) {
+                             text.append(prop.name);
+                             text.append(", ");
+                           });
                        text.chop(2);
                        line_edit->setText(text);
                      });
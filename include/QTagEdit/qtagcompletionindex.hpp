@@ -0,0 +1,110 @@
+#ifndef QTAGEDIT_Q_TAG_COMPLETION_INDEX_H_
+#define QTAGEDIT_Q_TAG_COMPLETION_INDEX_H_
+
+#include <QString>
+#include <QStringList>
+#include <QStringView>
+#include <functional>
+#include <memory>
+
+/// @brief A case insensitive prefix index over a list of tags
+///
+/// Tags are kept sorted by their case folded form, so that all tags starting
+/// with a prefix form a contiguous range found by binary search. Queries cost
+/// O(log n + k) for k results.
+///
+/// Copies share the same immutable data, so a single index can back any
+/// number of widgets and be handed to worker threads. Updates are copy on
+/// write, copies made before an update keep seeing the old tags.
+class QTagCompletionIndex {
+ public:
+  /// @brief A range of positions in the sorted index
+  struct Range {
+    qsizetype begin{0};
+    qsizetype end{0};
+
+    qsizetype size() const { return end - begin; }
+    bool isEmpty() const { return begin == end; }
+  };
+
+  /// @brief Returns true for tags that must be left out of the results
+  ///
+  /// Excluded tags do not count towards the limit, so queries still return
+  /// limit tags if enough others match. An empty function excludes nothing.
+  using Exclusion = std::function<bool(const QString &tag)>;
+
+  QTagCompletionIndex();
+  explicit QTagCompletionIndex(const QStringList &tags);
+
+  /// @brief Adds tags to the index
+  ///
+  /// Costs O(n + m log m) for m new tags, other copies are not affected.
+  void insert(const QStringList &tags);
+
+  /// @brief Removes tags from the index
+  ///
+  /// Costs O(n), other copies are not affected.
+  void remove(const QStringList &tags);
+
+  /// @brief Returns the number of distinct tags
+  qsizetype size() const;
+
+  /// @brief Returns true if the index contains no tags
+  bool isEmpty() const;
+
+  /// @brief Returns the tag at the given position in the sorted index
+  const QString &at(qsizetype position) const;
+
+  /// @brief Returns the range of tags starting with prefix, ignoring case
+  Range prefixRange(QStringView prefix) const;
+
+  /// @brief Returns the range of tags starting with prefix, ignoring case,
+  /// searching only within the given range
+  ///
+  /// Used to narrow down the range of a previous prefix that the new prefix
+  /// extends, which only costs O(log range.size()).
+  Range prefixRange(QStringView prefix, Range within) const;
+
+  /// @brief Returns up to limit tags of the given range in sorted order
+  QStringList tags(Range range, qsizetype limit,
+                   const Exclusion &exclude = {}) const;
+
+  /// @brief Returns up to limit tags starting with prefix, ignoring case
+  QStringList complete(QStringView prefix, qsizetype limit,
+                       const Exclusion &exclude = {}) const;
+
+  /// @brief Returns up to limit tags containing the pattern as a subsequence,
+  /// ignoring case, best matches first
+  ///
+  /// Matches at word starts and consecutive runs rank higher, so "hgt" finds
+  /// "height". Keys are pre-filtered by a bit mask of their characters before
+  /// scoring, which keeps a full scan in the range of milliseconds even for
+  /// hundreds of thousands of tags.
+  QStringList fuzzyComplete(QStringView pattern, qsizetype limit,
+                            const Exclusion &exclude = {}) const;
+
+  /// @brief Returns up to limit tags within the given edit distance of word,
+  /// ignoring case, closest first
+  ///
+  /// Up to a distance of 2 lookups go through an index of the deletions of
+  /// every key's first seven characters, so only a handful of candidates
+  /// are compared. Corrections that shift characters across that prefix
+  /// boundary may be missed. Larger distances scan all tags.
+  ///
+  /// The deletion index is built on the first call unless prepareSimilar()
+  /// was called before.
+  QStringList similar(QStringView word, int max_distance,
+                      qsizetype limit) const;
+
+  /// @brief Builds the index used by similar() ahead of time
+  ///
+  /// Costs O(n log n) and takes a while for large indexes, so call it on a
+  /// worker thread. Copies share the built index.
+  void prepareSimilar() const;
+
+ private:
+  struct Data;
+  std::shared_ptr<const Data> d;
+};
+
+#endif  // QTAGEDIT_Q_TAG_COMPLETION_INDEX_H_
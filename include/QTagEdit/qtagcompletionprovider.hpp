@@ -0,0 +1,164 @@
+#ifndef QTAGEDIT_Q_TAG_COMPLETION_PROVIDER_H_
+#define QTAGEDIT_Q_TAG_COMPLETION_PROVIDER_H_
+
+#include <QFuture>
+#include <QString>
+#include <QStringList>
+#include <memory>
+
+#include "qtagcompletionindex.hpp"
+
+/// @brief Source of tag completions
+///
+/// Providers are shared between widgets through std::shared_ptr and may be
+/// queried from worker threads, so implementations have to be thread safe.
+class QTagCompletionProvider
+    : public std::enable_shared_from_this<QTagCompletionProvider> {
+ public:
+  /// @brief How the typed text is matched against tags
+  enum class Matching { kPrefix, kFuzzy };
+
+  /// @brief Returns true for tags that must not be completed
+  ///
+  /// Excluded tags do not count towards the limit.
+  using Exclusion = QTagCompletionIndex::Exclusion;
+
+  virtual ~QTagCompletionProvider() = default;
+
+  /// @brief Returns up to limit tags starting with prefix
+  virtual QStringList complete(const QString &prefix, int limit,
+                               const Exclusion &exclude = {}) const = 0;
+
+  /// @brief Returns up to limit tags containing the pattern as a subsequence,
+  /// best matches first
+  ///
+  /// The default implementation falls back to complete().
+  virtual QStringList completeFuzzy(const QString &pattern, int limit,
+                                    const Exclusion &exclude = {}) const;
+
+  /// @brief Returns up to limit tags similar to tag, closest first
+  ///
+  /// Used to suggest corrections for misspelled tags. The default
+  /// implementation returns no suggestions.
+  virtual QStringList suggest(const QString &tag, int limit) const;
+
+  /// @brief Prepares suggest() in the background
+  ///
+  /// Called by widgets that can make use of suggestions, so that the first
+  /// one does not wait for an index to be built. The default implementation
+  /// does nothing.
+  virtual void prepareSuggestions() const;
+
+  /// @brief Returns up to limit tags matching text via a future
+  ///
+  /// The default implementation runs complete() or completeFuzzy() on the
+  /// global thread pool. Canceling the future skips queries that have not
+  /// started yet. The exclusion is called from the worker thread.
+  ///
+  /// If suggest_on_miss is set and nothing matches, the results of suggest()
+  /// follow as a second result, so that finding them does not block the
+  /// caller either.
+  virtual QFuture<QStringList> completeAsync(
+      const QString &text, int limit, Matching matching = Matching::kPrefix,
+      Exclusion exclude = {}, bool suggest_on_miss = false) const;
+};
+
+/// @brief Completes tags from an in-memory QTagCompletionIndex
+///
+/// Remembers the range of the last query and narrows it down when the next
+/// prefix extends the previous one.
+///
+/// Attach one provider to many widgets to share a single vocabulary. Updates
+/// swap in a new copy of the index, queries in flight finish on the old one.
+/// The index behind suggest() is built on the first call. Once
+/// prepareSuggestions() was called, it is built on the global thread pool
+/// instead, also whenever the index changes.
+class QTagMemoryCompletionProvider : public QTagCompletionProvider {
+ public:
+  explicit QTagMemoryCompletionProvider(const QStringList &tags);
+  explicit QTagMemoryCompletionProvider(QTagCompletionIndex index);
+  ~QTagMemoryCompletionProvider() override;
+
+  /// @brief Returns the index completions are taken from
+  QTagCompletionIndex index() const;
+
+  /// @brief Replaces the index completions are taken from
+  void setIndex(QTagCompletionIndex index);
+
+  /// @brief Adds tags to the index
+  void addTags(const QStringList &tags);
+
+  /// @brief Removes tags from the index
+  void removeTags(const QStringList &tags);
+
+  QStringList complete(const QString &prefix, int limit,
+                       const Exclusion &exclude = {}) const override;
+  QStringList completeFuzzy(const QString &pattern, int limit,
+                            const Exclusion &exclude = {}) const override;
+  QStringList suggest(const QString &tag, int limit) const override;
+  void prepareSuggestions() const override;
+
+ private:
+  struct Impl;
+  std::unique_ptr<Impl> impl;
+};
+
+/// @brief Completes tags from a newline delimited UTF-8 file
+///
+/// The file is only read on the first query, which with asynchronous
+/// completion happens on a worker thread. An unreadable file yields no
+/// completions.
+class QTagFileCompletionProvider : public QTagCompletionProvider {
+ public:
+  explicit QTagFileCompletionProvider(const QString &path);
+  ~QTagFileCompletionProvider() override;
+
+  QStringList complete(const QString &prefix, int limit,
+                       const Exclusion &exclude = {}) const override;
+  QStringList completeFuzzy(const QString &pattern, int limit,
+                            const Exclusion &exclude = {}) const override;
+  QStringList suggest(const QString &tag, int limit) const override;
+  void prepareSuggestions() const override;
+
+ private:
+  struct Impl;
+  std::unique_ptr<Impl> impl;
+};
+
+/// @brief Completes tags from a memory mapped index file
+///
+/// The file is mapped, not read, so opening even an index of millions of
+/// tags is immediate and only the pages touched by a query are loaded. A
+/// prefix query costs O(log n + k) for k results.
+///
+/// The index holds the tags sorted by their case folded form, see
+/// writeIndex() and the qtagindex tool. Fuzzy matching would have to read
+/// the whole file, so completeFuzzy() falls back to prefix matching.
+class QTagMappedCompletionProvider : public QTagCompletionProvider {
+ public:
+  explicit QTagMappedCompletionProvider(const QString &path);
+  ~QTagMappedCompletionProvider() override;
+
+  /// @brief Returns true if the file is a valid index and could be mapped
+  ///
+  /// An invalid index yields no completions.
+  bool isValid() const;
+
+  /// @brief Returns the number of tags in the index
+  qsizetype size() const;
+
+  QStringList complete(const QString &prefix, int limit,
+                       const Exclusion &exclude = {}) const override;
+
+  /// @brief Writes the tags of index to a file readable by this provider
+  ///
+  /// Returns false if the file could not be written.
+  static bool writeIndex(const QTagCompletionIndex &index,
+                         const QString &path);
+
+ private:
+  struct Impl;
+  std::unique_ptr<Impl> impl;
+};
+
+#endif  // QTAGEDIT_Q_TAG_COMPLETION_PROVIDER_H_
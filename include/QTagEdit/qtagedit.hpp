@@ -2,6 +2,7 @@
 #define QTAGEDIT_Q_TAG_EDIT_H_
 
 #include <QLineEdit>
+#include <QSet>
 #include <functional>
 #include <memory>
 
@@ -9,6 +10,9 @@ class QKeyEvent;
 class QPen;
 class QColor;
 class QStylePainter;
+class QTagCompletionIndex;
+class QTagCompletionProvider;
+class QTagUsageStats;
 
 class QTagEdit : public QLineEdit {
   Q_OBJECT
@@ -22,6 +26,72 @@ class QTagEdit : public QLineEdit {
 
   using PropertyList = QList<Property>;
 
+  /// @brief How tags are made unique
+  enum class Uniqueness {
+    /// @brief Duplicate tags are allowed
+    kNone,
+    /// @brief Duplicates are removed and the tags sorted once editing
+    /// finished
+    kSorted,
+    /// @brief Duplicates are removed in place once editing finished, adding
+    /// a tag that is already present does nothing
+    kOrdered,
+  };
+
+  /// @brief What happens to the values of properties with the same name
+  /// when tags are made unique
+  enum class PropertyMerge {
+    /// @brief Only the first property is kept, with its values
+    kKeepFirst,
+    /// @brief The values of all properties are joined into the first one
+    kMergeValues,
+    /// @brief Like kMergeValues, but values only appear once
+    kMergeUniqueValues,
+  };
+
+  /// @brief A non-owning view of a property
+  ///
+  /// Views point into the text of the widget and are only valid until the
+  /// tags change.
+  struct PropertyView {
+    QStringView name;
+    /// @brief The values including the separators between them
+    QStringView values;
+    QChar separator;
+    bool has_values{false};
+
+    /// @brief Calls callback(QStringView) for every value
+    template <typename F>
+    void forEachValue(F &&callback) const
+    {
+      if (!has_values) {
+        return;
+      }
+      qsizetype start = 0;
+      for (auto end = values.indexOf(separator); end >= 0;
+           end = values.indexOf(separator, start)) {
+        callback(values.sliced(start, end - start));
+        start = end + 1;
+      }
+      callback(values.sliced(start));
+    }
+  };
+
+  /// @brief Batches all changes to the tags during its lifetime
+  ///
+  /// Calls beginUpdate() on construction and endUpdate() on destruction.
+  class UpdateGuard {
+   public:
+    explicit UpdateGuard(QTagEdit &edit) : edit{edit} { edit.beginUpdate(); }
+    ~UpdateGuard() { edit.endUpdate(); }
+
+    UpdateGuard(const UpdateGuard &) = delete;
+    UpdateGuard &operator=(const UpdateGuard &) = delete;
+
+   private:
+    QTagEdit &edit;
+  };
+
   struct Style {
     QColor line_color;
     QColor shade_color;
@@ -35,15 +105,115 @@ class QTagEdit : public QLineEdit {
   void setTags(const QStringList &tags);
 
   /// @brief Sets the tags for completion
+  ///
+  /// The tags are indexed once, completing a prefix then costs
+  /// O(log n + limit) regardless of the number of tags.
   void setTagsForCompletion(const QStringList &tags);
 
+  /// @brief Sets the tags for completion from an existing index
+  ///
+  /// The index is shared rather than copied, so any number of widgets can
+  /// complete from the same vocabulary at constant memory cost.
+  void setTagsForCompletion(const QTagCompletionIndex &index);
+
+  /// @brief Sets the tags for completion from a memory mapped index file
+  ///
+  /// Opening the file costs O(1) regardless of its size, see
+  /// QTagMappedCompletionProvider. Returns false and leaves completion
+  /// unchanged if the file is not a valid index.
+  bool setTagsForCompletionFromIndex(const QString &path);
+
+  /// @brief Sets the source of completions
+  ///
+  /// Replaces the tags set by setTagsForCompletion(). A provider can be shared
+  /// by any number of widgets, passing nullptr disables completion.
+  void setCompletionProvider(
+      std::shared_ptr<const QTagCompletionProvider> provider);
+
+  /// @brief Sets the values for completion of a property
+  ///
+  /// Once the property separator has been typed after the property name, only
+  /// these values are offered.
+  /// @param property The property name the values belong to
+  /// @param values The values to complete
+  void setValuesForCompletion(const QString &property,
+                              const QStringList &values);
+
+  /// @brief Sets the source of value completions for a property
+  ///
+  /// Like setValuesForCompletion(), passing nullptr removes the values.
+  void setValueCompletionProvider(
+      const QString &property,
+      std::shared_ptr<const QTagCompletionProvider> provider);
+
+  /// @brief Sets whether completions are computed asynchronously
+  ///
+  /// When enabled the completion query runs on a worker thread once typing
+  /// paused for the given delay, and results for outdated input are dropped.
+  /// @param async Whether to complete asynchronously
+  /// @param delay_ms The pause in typing after which a query is started
+  void setAsyncCompletion(bool async, int delay_ms = 50);
+
+  /// @brief Sets the usage stats used to rank completions
+  ///
+  /// Tags accepted through addTag() or by finishing an edit are recorded, and
+  /// the completions of the provider are reordered to offer the most
+  /// frequently and recently used ones first. Stats can be shared between
+  /// widgets, pass nullptr to rank by the provider's order only.
+  void setUsageStats(std::shared_ptr<QTagUsageStats> stats);
+
+  /// @brief Sets whether completions match fuzzily
+  ///
+  /// When enabled the typed text matches any tag containing it as a
+  /// subsequence, e.g. "hgt" matches "height", best matches first.
+  void setFuzzyCompletion(bool fuzzy);
+
+  /// @brief Returns valid tags similar to the given one, closest first
+  ///
+  /// Suggestions come from the completion provider and are checked against
+  /// the tag filter. They are also offered as completions when a tag that
+  /// does not match the filter has no regular completions, those are looked
+  /// up on a worker thread even without asynchronous completion.
+  /// @param tag The possibly misspelled tag
+  /// @param limit The maximum number of suggestions
+  QStringList suggestTags(const QString &tag, int limit = 5);
+
+  /// @brief Sets the maximum number of completions shown at once
+  void setCompletionLimit(int limit);
+
   /// @brief Returns the tags
   /// @returns The tags as a list of strings
   QStringList getTags() const;
 
+  /// @brief Returns the number of tags
+  qsizetype tagCount() const;
+
+  /// @brief Returns a view of the tag at the given index
+  ///
+  /// The view is only valid until the tags change.
+  QStringView tagView(qsizetype index) const;
+
+  /// @brief Calls callback(QStringView) for every tag without copying it
+  template <typename F>
+  void forEachTag(F &&callback) const
+  {
+    const auto count = tagCount();
+    for (qsizetype i = 0; i < count; ++i) {
+      callback(tagView(i));
+    }
+  }
+
   /// @brief Appends a single tag
+  ///
+  /// Adding many tags this way sets the text every time, use addTags() or
+  /// a batch, see beginUpdate(), instead.
   void addTag(const QString &tag);
 
+  /// @brief Appends tags
+  ///
+  /// Costs O(total length) with a single allocation for the new text.
+  void addTags(const QStringList &tags);
+
   /// @brief Removes the last tag
   void removeLastTag();
 
@@ -59,6 +229,22 @@ class QTagEdit : public QLineEdit {
   /// been set.
   void addProperty(const Property &property);
 
+  /// @brief Appends properties
+  ///
+  /// Costs O(total length) with a single allocation for the new text.
+  void addProperties(const PropertyList &properties);
+
+  /// @brief Starts a batch of changes to the tags
+  ///
+  /// Until the matching endUpdate() the text of the line edit is left alone,
+  /// the getters already see the changes though. Batches nest, only the
+  /// outermost endUpdate() sets the text, which emits tagsChanged and
+  /// repaints once for the whole batch.
+  void beginUpdate();
+
+  /// @brief Ends a batch of changes started by beginUpdate()
+  void endUpdate();
+
   /// @brief Returns the tags as a list of properties.
   ///
   /// It only makes sense to use this function if the property separator has
@@ -66,6 +252,26 @@ class QTagEdit : public QLineEdit {
   /// @return The tags as a list of properties with their associated values
   PropertyList getProperties() const;
 
+  /// @brief Returns a view of the tag at the given index as a property
+  ///
+  /// It only makes sense to use this function if the property separator has
+  /// been set. The view is only valid until the tags change.
+  PropertyView propertyView(qsizetype index) const;
+
+  /// @brief Calls callback(const PropertyView &) for every property without
+  /// copying it
+  ///
+  /// It only makes sense to use this function if the property separator has
+  /// been set.
+  template <typename F>
+  void forEachProperty(F &&callback) const
+  {
+    const auto count = tagCount();
+    for (qsizetype i = 0; i < count; ++i) {
+      callback(propertyView(i));
+    }
+  }
+
   /// @brief Sets the primary colors
   /// @param line_color The color to be used to render the underline
   /// @param shade_color The color to be used to render the tag background
@@ -83,10 +289,29 @@ class QTagEdit : public QLineEdit {
   /// @brief Sets the tag filter
   ///
   /// If a tag matches the filter it is rendered with the default color,
-  /// otherwise it is rendered with the secondary color.
+  /// otherwise it is rendered with the secondary color. Results are cached per
+  /// tag, see invalidateTagFilter(). Replaces any tags set by setValidTags().
   /// @param filter The filter function
   void setTagFilter(std::function<bool(const QString &)> filter);
 
+  /// @brief Sets the tags that match the filter
+  ///
+  /// A faster alternative to setTagFilter() for allow-lists, tags are looked
+  /// up in a hash set. Replaces any filter set by setTagFilter().
+  /// @param tags The tags to be rendered with the default color
+  /// @param sensitivity Whether tags have to match in case
+  void setValidTags(const QSet<QString> &tags,
+                    Qt::CaseSensitivity sensitivity = Qt::CaseSensitive);
+
+  /// @brief Discards all cached results of the tag filter
+  ///
+  /// The filter is only called once per distinct tag. Call this whenever the
+  /// filter would now decide differently, e.g. when its allow-list changed.
+  void invalidateTagFilter();
+
+  /// @brief Discards the cached result of the tag filter for a single tag
+  void invalidateTagFilter(const QString &tag);
+
   /// @brief Sets the property separator
   ///
   /// When set tags are rendered as properties with a name and a list of
@@ -98,8 +323,25 @@ class QTagEdit : public QLineEdit {
   /// @brief Sets tags to be unique
   ///
   /// If unique is set to true, tags will be collapsed to be unique
+  /// and tags already present are no longer offered as completions. Same as
+  /// setUniqueTags(Uniqueness::kSorted) or setUniqueTags(Uniqueness::kNone).
   void setUniqueTags(bool unique);
 
+  /// @brief Sets how tags are made unique
+  ///
+  /// With Uniqueness::kOrdered the widget keeps count of its tags as they
+  /// are edited, so finishing an edit without duplicates costs O(1) and
+  /// removing them a single pass that keeps the order of the tags.
+  void setUniqueTags(Uniqueness uniqueness);
+
+  /// @brief Sets how the values of duplicate properties are handled
+  ///
+  /// Only applies if the property separator has been set. Merging groups
+  /// the properties by name in a single pass over the tags. With
+  /// Uniqueness::kOrdered added properties are merged as they are added,
+  /// in one pass at the end of the batch, see beginUpdate().
+  void setPropertyMerge(PropertyMerge merge);
+
   /// @brief overriden sizeHint
   QSize sizeHint() const override;
 
@@ -114,16 +356,47 @@ class QTagEdit : public QLineEdit {
   /// @brief This signal is emitted whenever the tags are edited by the user
   void tagsEdited();
 
+  /// @brief This signal is emitted along with tagsChanged() with the tags
+  /// that changed
+  ///
+  /// Computed from the edit rather than the whole list, so it costs
+  /// O(changed) per change, and only while the signal is connected. Moved
+  /// holds tags that were removed and inserted again by the same change,
+  /// e.g. when tags are reordered. Untouched tags next to an edit are not
+  /// reported.
+  void tagsDiff(const QStringList &added, const QStringList &removed,
+                const QStringList &moved);
+
  protected:
   void paintEvent(QPaintEvent *event) override;
   void keyPressEvent(QKeyEvent *event) override;
+  void changeEvent(QEvent *event) override;
+  void connectNotify(const QMetaMethod &signal) override;
+  void disconnectNotify(const QMetaMethod &signal) override;
 
  private:
-  void renderTags(QStylePainter &painter, QRect rect);
-  void renderTagBackgrounds(QStylePainter &painter, QRect rect, bool line_only);
+  void ensureCompleter();
+  void updateCompletions();
+  void startAsyncCompletion();
+  void insertCompletion(const QString &completion);
+  void showCompletions(QStringList completions);
+  bool wantsSuggestions();
+  QStringList validSuggestions(QStringList suggestions);
+  void recordEditedTags();
+  void emitTagsDiff();
+  void layoutTags(QRect rect);
+  void renderTags(QStylePainter &painter, bool line_only);
+  void updatePens();
   QPen getPenForColor(const QColor &color);
   bool Filter(const QString &tag);
   void makeTagsUnique();
+  void makeTagsUniqueSorted();
+  void makeTagsUniqueOrdered();
+  void mergeProperties(bool sort);
+  void mergeAddedProperties();
+  void commitText(const QString &text);
+  QString &beginAppend(qsizetype size);
+  void endAppend();
 
   struct Impl;
   std::unique_ptr<Impl> impl;
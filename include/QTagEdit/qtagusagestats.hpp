@@ -0,0 +1,43 @@
+#ifndef QTAGEDIT_Q_TAG_USAGE_STATS_H_
+#define QTAGEDIT_Q_TAG_USAGE_STATS_H_
+
+#include <QString>
+#include <QStringList>
+#include <chrono>
+#include <memory>
+
+/// @brief Frequency and recency of accepted tags, used to rank completions
+///
+/// Every use of a tag adds one to its score, and scores halve after every
+/// half-life without use. Tags are matched ignoring case. The stats can be
+/// shared by several widgets of the same thread, but are not thread safe.
+class QTagUsageStats {
+ public:
+  explicit QTagUsageStats(
+      std::chrono::seconds half_life = std::chrono::days{30});
+  ~QTagUsageStats();
+
+  /// @brief Records a use of the tag now
+  void record(const QString &tag);
+
+  /// @brief Returns the current score of the tag, 0 if it was never used
+  double score(const QString &tag) const;
+
+  /// @brief Returns up to limit of the highest scored tags starting with
+  /// prefix, ignoring case, best first
+  QStringList top(const QString &prefix, int limit) const;
+
+  /// @brief Replaces the stats with the ones stored in the file
+  /// @return false if the file could not be read
+  bool load(const QString &path);
+
+  /// @brief Stores the stats in the file
+  /// @return false if the file could not be written
+  bool save(const QString &path) const;
+
+ private:
+  struct Impl;
+  std::unique_ptr<Impl> impl;
+};
+
+#endif  // QTAGEDIT_Q_TAG_USAGE_STATS_H_
@@ -0,0 +1,446 @@
+// QTagEdit
+// Copyright (C) 2024  Julian Gottwald
+//
+// This library is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License Version 3 as
+// published by the Free Software Foundation.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this library.  If not, see <https://www.gnu.org/licenses/>.
+#include "qtagcompletionindex.hpp"
+
+#include <QSet>
+#include <QVarLengthArray>
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstdlib>
+#include <functional>
+#include <iterator>
+#include <mutex>
+#include <queue>
+#include <utility>
+#include <vector>
+
+namespace {
+
+/// @brief A case folded key and its tag
+using Entry = std::pair<QString, QString>;
+
+std::vector<Entry> sortedEntries(const QStringList &tags)
+{
+  auto entries = std::vector<Entry>{};
+  entries.reserve(tags.size());
+  for (const auto &tag : tags) {
+    if (!tag.isEmpty()) {
+      entries.emplace_back(tag.toCaseFolded(), tag);
+    }
+  }
+  std::sort(entries.begin(), entries.end());
+  entries.erase(std::unique(entries.begin(), entries.end()), entries.end());
+  return entries;
+}
+
+/// @brief Returns a bit set of the characters in a case folded string
+///
+/// Letters and digits get a bit each, everything else shares the rest. A
+/// pattern can only be a subsequence of a key if its mask is a subset.
+quint64 characterMask(QStringView folded)
+{
+  quint64 mask = 0;
+  for (auto c : folded) {
+    const auto unicode = c.unicode();
+    if (unicode >= u'a' && unicode <= u'z') {
+      mask |= quint64{1} << (unicode - u'a');
+    } else if (unicode >= u'0' && unicode <= u'9') {
+      mask |= quint64{1} << (26 + unicode - u'0');
+    } else {
+      mask |= quint64{1} << (36 + unicode % 28);
+    }
+  }
+  return mask;
+}
+
+constexpr int kWordStartBonus = 8;
+constexpr int kConsecutiveBonus = 4;
+constexpr int kGapPenalty = 1;
+
+/// @brief Scores the pattern as a subsequence of the key, -1 if it is none
+///
+/// Matches at word starts and runs of consecutive matches score higher, gaps
+/// between matches lower. Both strings are case folded, the tag is only used
+/// to find camel case word starts.
+int fuzzyScore(QStringView pattern, QStringView key, QStringView tag)
+{
+  const auto camel_case = key.size() == tag.size();
+  int score = 0;
+  qsizetype last_match = -1;
+  qsizetype pos = 0;
+  for (auto c : pattern) {
+    while (pos < key.size() && key[pos] != c) {
+      ++pos;
+    }
+    if (pos == key.size()) {
+      return -1;
+    }
+    const auto word_start =
+        pos == 0 || !key[pos - 1].isLetterOrNumber() ||
+        (camel_case && tag[pos].isUpper() && tag[pos - 1].isLower());
+    if (word_start) {
+      score += kWordStartBonus;
+    }
+    if (last_match >= 0) {
+      if (pos == last_match + 1) {
+        score += kConsecutiveBonus;
+      } else {
+        score -= kGapPenalty * static_cast<int>(pos - last_match - 1);
+      }
+    }
+    last_match = pos++;
+  }
+  return score;
+}
+
+/// @brief Returns the Levenshtein distance between two strings
+int editDistance(QStringView a, QStringView b)
+{
+  QVarLengthArray<int, 64> previous(b.size() + 1);
+  QVarLengthArray<int, 64> current(b.size() + 1);
+  for (qsizetype j = 0; j <= b.size(); ++j) {
+    previous[j] = static_cast<int>(j);
+  }
+  for (qsizetype i = 1; i <= a.size(); ++i) {
+    current[0] = static_cast<int>(i);
+    for (qsizetype j = 1; j <= b.size(); ++j) {
+      const auto substitution =
+          previous[j - 1] + (a[i - 1] == b[j - 1] ? 0 : 1);
+      current[j] =
+          std::min({previous[j] + 1, current[j - 1] + 1, substitution});
+    }
+    std::swap(previous, current);
+  }
+  return previous[b.size()];
+}
+
+constexpr int kMaxDeletionDistance = 2;
+constexpr qsizetype kDeletionPrefixLength = 7;
+// 1 + 7 + 21 variants of a seven character prefix
+constexpr qsizetype kMaxDeletionVariants = 29;
+
+/// @brief Collects the hashes of all variants of the key's prefix with up to
+/// max_distance characters deleted
+///
+/// A substitution or insertion is a deletion from one of the two strings,
+/// so two strings within an edit distance share a variant with no more
+/// deletions than that from each.
+void deletionHashes(QStringView key,
+                    QVarLengthArray<quint32, kMaxDeletionVariants> &hashes,
+                    int max_distance = kMaxDeletionDistance)
+{
+  const auto prefix = key.first(std::min(key.size(), kDeletionPrefixLength));
+  const auto size = prefix.size();
+  std::array<QChar, kDeletionPrefixLength> buffer{};
+  auto hash_without = [&](qsizetype first, qsizetype second) {
+    qsizetype length = 0;
+    for (qsizetype i = 0; i < size; ++i) {
+      if (i != first && i != second) {
+        buffer[length++] = prefix[i];
+      }
+    }
+    return static_cast<quint32>(qHash(QStringView{buffer.data(), length}));
+  };
+
+  hashes.clear();
+  hashes.append(hash_without(-1, -1));
+  for (qsizetype first = 0; max_distance >= 1 && first < size; ++first) {
+    hashes.append(hash_without(first, -1));
+    for (auto second = first + 1; max_distance >= 2 && second < size;
+         ++second) {
+      hashes.append(hash_without(first, second));
+    }
+  }
+  // Repeated characters give the same variant more than once
+  std::sort(hashes.begin(), hashes.end());
+  hashes.erase(std::unique(hashes.begin(), hashes.end()), hashes.end());
+}
+
+}  // namespace
+
+struct QTagCompletionIndex::Data {
+  // All sorted by the case folded keys
+  std::vector<QString> keys{};
+  std::vector<QString> tags{};
+  // characterMask() of each key, kept apart so the pre-filter scans a flat
+  // array
+  std::vector<quint64> masks{};
+
+  /// @brief Hash of a deletion variant and the position of its key
+  using Deletion = std::pair<quint32, quint32>;
+
+  // Built for the first similarity query, not every index needs one. Sorted,
+  // so that all keys sharing a variant form a contiguous range.
+  mutable std::once_flag deletions_once{};
+  mutable std::vector<Deletion> deletions{};
+
+  static std::shared_ptr<const Data> fromEntries(std::vector<Entry> entries);
+
+  void buildDeletions() const;
+};
+
+void QTagCompletionIndex::Data::buildDeletions() const
+{
+  deletions.reserve(keys.size() * 8);
+  auto hashes = QVarLengthArray<quint32, kMaxDeletionVariants>{};
+  for (std::size_t position = 0; position < keys.size(); ++position) {
+    deletionHashes(keys[position], hashes);
+    for (auto hash : hashes) {
+      deletions.emplace_back(hash, static_cast<quint32>(position));
+    }
+  }
+  std::sort(deletions.begin(), deletions.end());
+}
+
+std::shared_ptr<const QTagCompletionIndex::Data>
+QTagCompletionIndex::Data::fromEntries(std::vector<Entry> entries)
+{
+  auto data = std::make_shared<Data>();
+  data->keys.reserve(entries.size());
+  data->tags.reserve(entries.size());
+  data->masks.reserve(entries.size());
+  for (auto &[key, tag] : entries) {
+    data->masks.push_back(characterMask(key));
+    data->keys.push_back(std::move(key));
+    data->tags.push_back(std::move(tag));
+  }
+  return data;
+}
+
+QTagCompletionIndex::QTagCompletionIndex() : d{std::make_shared<Data>()} {}
+
+QTagCompletionIndex::QTagCompletionIndex(const QStringList &tags)
+    : d{Data::fromEntries(sortedEntries(tags))}
+{
+}
+
+void QTagCompletionIndex::insert(const QStringList &tags)
+{
+  auto added = sortedEntries(tags);
+  if (added.empty()) {
+    return;
+  }
+  auto existing = std::vector<Entry>{};
+  existing.reserve(d->tags.size());
+  for (std::size_t i = 0; i < d->tags.size(); ++i) {
+    existing.emplace_back(d->keys[i], d->tags[i]);
+  }
+  auto merged = std::vector<Entry>{};
+  merged.reserve(existing.size() + added.size());
+  std::merge(existing.begin(), existing.end(), added.begin(), added.end(),
+             std::back_inserter(merged));
+  merged.erase(std::unique(merged.begin(), merged.end()), merged.end());
+  d = Data::fromEntries(std::move(merged));
+}
+
+void QTagCompletionIndex::remove(const QStringList &tags)
+{
+  const auto removed = QSet<QString>{tags.begin(), tags.end()};
+  auto data = std::make_shared<Data>();
+  data->keys.reserve(d->tags.size());
+  data->tags.reserve(d->tags.size());
+  data->masks.reserve(d->tags.size());
+  for (std::size_t i = 0; i < d->tags.size(); ++i) {
+    if (!removed.contains(d->tags[i])) {
+      data->keys.push_back(d->keys[i]);
+      data->tags.push_back(d->tags[i]);
+      data->masks.push_back(d->masks[i]);
+    }
+  }
+  d = std::move(data);
+}
+
+qsizetype QTagCompletionIndex::size() const
+{
+  return static_cast<qsizetype>(d->tags.size());
+}
+
+bool QTagCompletionIndex::isEmpty() const { return d->tags.empty(); }
+
+const QString &QTagCompletionIndex::at(qsizetype position) const
+{
+  return d->tags[position];
+}
+
+QTagCompletionIndex::Range QTagCompletionIndex::prefixRange(
+    QStringView prefix) const
+{
+  return prefixRange(prefix, {.begin = 0, .end = size()});
+}
+
+QTagCompletionIndex::Range QTagCompletionIndex::prefixRange(
+    QStringView prefix, Range within) const
+{
+  if (prefix.isEmpty()) {
+    return within;
+  }
+  const auto folded = prefix.toString().toCaseFolded();
+  const auto begin = d->keys.begin() + within.begin;
+  const auto end = d->keys.begin() + within.end;
+  auto first = std::partition_point(
+      begin, end, [&](const QString &key) { return key < folded; });
+  auto last = std::partition_point(
+      first, end, [&](const QString &key) { return key.startsWith(folded); });
+  return {.begin = first - d->keys.begin(), .end = last - d->keys.begin()};
+}
+
+QStringList QTagCompletionIndex::tags(Range range, qsizetype limit,
+                                      const Exclusion &exclude) const
+{
+  auto result = QStringList{};
+  if (!exclude) {
+    const auto end = std::min(range.end, range.begin + limit);
+    result.reserve(std::max<qsizetype>(end - range.begin, 0));
+    for (auto i = range.begin; i < end; ++i) {
+      result.append(d->tags[i]);
+    }
+    return result;
+  }
+  for (auto i = range.begin; i < range.end && result.size() < limit; ++i) {
+    if (!exclude(d->tags[i])) {
+      result.append(d->tags[i]);
+    }
+  }
+  return result;
+}
+
+QStringList QTagCompletionIndex::complete(QStringView prefix, qsizetype limit,
+                                          const Exclusion &exclude) const
+{
+  return tags(prefixRange(prefix), limit, exclude);
+}
+
+QStringList QTagCompletionIndex::fuzzyComplete(QStringView pattern,
+                                               qsizetype limit,
+                                               const Exclusion &exclude) const
+{
+  if (pattern.isEmpty()) {
+    return tags({.begin = 0, .end = size()}, limit, exclude);
+  }
+  if (limit <= 0) {
+    return {};
+  }
+  const auto folded = pattern.toString().toCaseFolded();
+  const auto pattern_mask = characterMask(folded);
+
+  // Bounded min-heap of (score, -position), the worst candidate is on top
+  using Candidate = std::pair<int, qsizetype>;
+  auto heap = std::priority_queue<Candidate, std::vector<Candidate>,
+                                  std::greater<Candidate>>{};
+
+  const auto &masks = d->masks;
+  const auto count = masks.size();
+  for (std::size_t block = 0; block < count; block += 64) {
+    // Branch free, so the compiler can vectorize the pre-filter
+    const auto block_size = std::min<std::size_t>(64, count - block);
+    quint64 hits = 0;
+    for (std::size_t i = 0; i < block_size; ++i) {
+      hits |= static_cast<quint64>((masks[block + i] & pattern_mask) ==
+                                   pattern_mask)
+              << i;
+    }
+    while (hits != 0) {
+      const auto position = block + std::countr_zero(hits);
+      hits &= hits - 1;
+      if (exclude && exclude(d->tags[position])) {
+        continue;
+      }
+      const auto score =
+          fuzzyScore(folded, d->keys[position], d->tags[position]);
+      if (score < 0) {
+        continue;
+      }
+      const auto candidate =
+          Candidate{score, -static_cast<qsizetype>(position)};
+      if (static_cast<qsizetype>(heap.size()) < limit) {
+        heap.push(candidate);
+      } else if (heap.top() < candidate) {
+        heap.pop();
+        heap.push(candidate);
+      }
+    }
+  }
+
+  auto result = QStringList{};
+  result.resize(static_cast<qsizetype>(heap.size()));
+  for (auto i = result.size() - 1; i >= 0; --i) {
+    result[i] = d->tags[-heap.top().second];
+    heap.pop();
+  }
+  return result;
+}
+
+QStringList QTagCompletionIndex::similar(QStringView word, int max_distance,
+                                         qsizetype limit) const
+{
+  if (isEmpty() || limit <= 0 || max_distance < 0) {
+    return {};
+  }
+  const auto folded = word.toString().toCaseFolded();
+  auto within = [&](std::size_t position) {
+    const auto &key = d->keys[position];
+    if (std::abs(key.size() - folded.size()) > max_distance) {
+      return -1;
+    }
+    const auto distance = editDistance(folded, key);
+    return distance <= max_distance ? distance : -1;
+  };
+
+  // (distance, position), so sorting puts the closest first and keeps the
+  // index order among equally close ones
+  auto matches = std::vector<std::pair<int, qsizetype>>{};
+  if (max_distance > kMaxDeletionDistance) {
+    for (std::size_t position = 0; position < d->keys.size(); ++position) {
+      if (const auto distance = within(position); distance >= 0) {
+        matches.emplace_back(distance, static_cast<qsizetype>(position));
+      }
+    }
+  } else {
+    prepareSimilar();
+    // Two keys within the distance share a variant with at most that many
+    // deletions from each, see deletionHashes()
+    auto hashes = QVarLengthArray<quint32, kMaxDeletionVariants>{};
+    deletionHashes(folded, hashes, max_distance);
+    auto candidates = QSet<quint32>{};
+    for (auto hash : hashes) {
+      auto range = std::equal_range(
+          d->deletions.begin(), d->deletions.end(), Data::Deletion{hash, 0},
+          [](const auto &a, const auto &b) { return a.first < b.first; });
+      for (auto it = range.first; it != range.second; ++it) {
+        candidates.insert(it->second);
+      }
+    }
+    for (auto position : candidates) {
+      if (const auto distance = within(position); distance >= 0) {
+        matches.emplace_back(distance, static_cast<qsizetype>(position));
+      }
+    }
+  }
+
+  const auto count = std::min<qsizetype>(limit, matches.size());
+  std::partial_sort(matches.begin(), matches.begin() + count, matches.end());
+  auto result = QStringList{};
+  result.reserve(count);
+  for (qsizetype i = 0; i < count; ++i) {
+    result.append(d->tags[matches[i].second]);
+  }
+  return result;
+}
+
+void QTagCompletionIndex::prepareSimilar() const
+{
+  std::call_once(d->deletions_once, [this]() { d->buildDeletions(); });
+}
@@ -0,0 +1,441 @@
+// QTagEdit
+// Copyright (C) 2024  Julian Gottwald
+//
+// This library is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License Version 3 as
+// published by the Free Software Foundation.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this library.  If not, see <https://www.gnu.org/licenses/>.
+#include "qtagcompletionprovider.hpp"
+
+#include <QByteArray>
+#include <QByteArrayView>
+#include <QFile>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QPromise>
+#include <QSaveFile>
+#include <QTextStream>
+#include <QThreadPool>
+#include <QtEndian>
+#include <utility>
+
+namespace {
+
+// Index file layout, all numbers little endian:
+//   quint32 magic, quint32 version, quint64 count
+//   quint64 offsets[count + 1] into the entries
+//   entries, each the UTF-8 case folded key, a null byte and the UTF-8 tag
+constexpr quint32 kIndexMagic{0x51544749};
+constexpr quint32 kIndexVersion{1};
+constexpr qsizetype kIndexHeaderSize{16};
+constexpr qsizetype kIndexOffsetSize{8};
+
+/// @brief Returns the first position in [begin, end) for which pred is false
+template <typename Predicate>
+qsizetype partitionPoint(qsizetype begin, qsizetype end, Predicate pred)
+{
+  while (begin < end) {
+    const auto middle = begin + (end - begin) / 2;
+    if (pred(middle)) {
+      begin = middle + 1;
+    } else {
+      end = middle;
+    }
+  }
+  return begin;
+}
+
+}  // namespace
+
+QStringList QTagCompletionProvider::completeFuzzy(
+    const QString &pattern, int limit, const Exclusion &exclude) const
+{
+  return complete(pattern, limit, exclude);
+}
+
+QStringList QTagCompletionProvider::suggest(const QString & /*tag*/,
+                                            int /*limit*/) const
+{
+  return {};
+}
+
+void QTagCompletionProvider::prepareSuggestions() const {}
+
+QFuture<QStringList> QTagCompletionProvider::completeAsync(
+    const QString &text, int limit, Matching matching, Exclusion exclude,
+    bool suggest_on_miss) const
+{
+  auto promise = std::make_shared<QPromise<QStringList>>();
+  auto future = promise->future();
+  QThreadPool::globalInstance()->start(
+      [self = shared_from_this(), promise, text, limit, matching,
+       exclude = std::move(exclude), suggest_on_miss]() {
+        promise->start();
+        if (!promise->isCanceled()) {
+          auto completions = matching == Matching::kFuzzy
+                                 ? self->completeFuzzy(text, limit, exclude)
+                                 : self->complete(text, limit, exclude);
+          const auto missed = completions.isEmpty();
+          promise->addResult(std::move(completions));
+          if (missed && suggest_on_miss && !promise->isCanceled()) {
+            promise->addResult(self->suggest(text, limit));
+          }
+        }
+        promise->finish();
+      });
+  return future;
+}
+
+struct QTagMemoryCompletionProvider::Impl {
+  // Serializes updates, so that concurrent ones do not get lost
+  QMutex update_mutex{};
+  // Guards all other members, queries only hold it to take a snapshot of the
+  // index
+  QMutex mutex{};
+  QTagCompletionIndex index{};
+  // Incremented on every update of the index
+  quint64 generation{0};
+
+  // The last query, shared by all callers
+  QString last_prefix{};
+  QTagCompletionIndex::Range last_range{};
+
+  // Set by prepareSuggestions(), most providers are never asked for any
+  bool prepare_suggestions{false};
+
+  void reset(QTagCompletionIndex new_index);
+  void prepareSimilar() const;
+};
+
+void QTagMemoryCompletionProvider::Impl::reset(QTagCompletionIndex new_index)
+{
+  index = std::move(new_index);
+  ++generation;
+  if (prepare_suggestions) {
+    prepareSimilar();
+  }
+  last_prefix.clear();
+  last_range = {.begin = 0, .end = index.size()};
+}
+
+void QTagMemoryCompletionProvider::Impl::prepareSimilar() const
+{
+  // Suggestions need an index of their own, which takes too long to build
+  // on the first misspelled tag
+  if (!index.isEmpty()) {
+    QThreadPool::globalInstance()->start(
+        [index = index]() { index.prepareSimilar(); });
+  }
+}
+
+QTagMemoryCompletionProvider::QTagMemoryCompletionProvider(
+    const QStringList &tags)
+    : QTagMemoryCompletionProvider(QTagCompletionIndex{tags})
+{
+}
+
+QTagMemoryCompletionProvider::QTagMemoryCompletionProvider(
+    QTagCompletionIndex index)
+    : impl{std::make_unique<Impl>()}
+{
+  impl->reset(std::move(index));
+}
+
+QTagMemoryCompletionProvider::~QTagMemoryCompletionProvider() = default;
+
+QTagCompletionIndex QTagMemoryCompletionProvider::index() const
+{
+  QMutexLocker lock(&impl->mutex);
+  return impl->index;
+}
+
+void QTagMemoryCompletionProvider::setIndex(QTagCompletionIndex index)
+{
+  QMutexLocker update_lock(&impl->update_mutex);
+  QMutexLocker lock(&impl->mutex);
+  impl->reset(std::move(index));
+}
+
+void QTagMemoryCompletionProvider::addTags(const QStringList &tags)
+{
+  QMutexLocker update_lock(&impl->update_mutex);
+  // The new index is built without blocking queries, they keep using the
+  // old one until it is swapped in
+  auto index = this->index();
+  index.insert(tags);
+  QMutexLocker lock(&impl->mutex);
+  impl->reset(std::move(index));
+}
+
+void QTagMemoryCompletionProvider::removeTags(const QStringList &tags)
+{
+  QMutexLocker update_lock(&impl->update_mutex);
+  auto index = this->index();
+  index.remove(tags);
+  QMutexLocker lock(&impl->mutex);
+  impl->reset(std::move(index));
+}
+
+QStringList QTagMemoryCompletionProvider::complete(
+    const QString &prefix, int limit, const Exclusion &exclude) const
+{
+  QMutexLocker lock(&impl->mutex);
+  const auto index = impl->index;
+  const auto generation = impl->generation;
+  auto range = QTagCompletionIndex::Range{.begin = 0, .end = index.size()};
+  // Appending to the prefix can only shrink its range, anything else, like a
+  // deletion or a jump to another tag, needs a full query
+  if (prefix.startsWith(impl->last_prefix)) {
+    range = impl->last_range;
+  }
+  lock.unlock();
+
+  range = index.prefixRange(prefix, range);
+
+  lock.relock();
+  if (generation == impl->generation) {
+    impl->last_prefix = prefix;
+    impl->last_range = range;
+  }
+  lock.unlock();
+  return index.tags(range, limit, exclude);
+}
+
+QStringList QTagMemoryCompletionProvider::completeFuzzy(
+    const QString &pattern, int limit, const Exclusion &exclude) const
+{
+  return index().fuzzyComplete(pattern, limit, exclude);
+}
+
+QStringList QTagMemoryCompletionProvider::suggest(const QString &tag,
+                                                  int limit) const
+{
+  // Short tags only tolerate a single typo, or everything would be similar
+  const auto max_distance = tag.size() <= 4 ? 1 : 2;
+  return index().similar(tag, max_distance, limit);
+}
+
+void QTagMemoryCompletionProvider::prepareSuggestions() const
+{
+  QMutexLocker lock(&impl->mutex);
+  if (!impl->prepare_suggestions) {
+    impl->prepare_suggestions = true;
+    impl->prepareSimilar();
+  }
+}
+
+struct QTagFileCompletionProvider::Impl {
+  QString path{};
+
+  QMutex mutex{};
+  std::unique_ptr<QTagMemoryCompletionProvider> provider{};
+
+  const QTagMemoryCompletionProvider &load();
+};
+
+const QTagMemoryCompletionProvider &QTagFileCompletionProvider::Impl::load()
+{
+  QMutexLocker lock(&mutex);
+  if (provider == nullptr) {
+    auto tags = QStringList{};
+    QFile file(path);
+    if (file.open(QIODevice::ReadOnly | QIODevice::Text)) {
+      QTextStream stream(&file);
+      QString line;
+      while (stream.readLineInto(&line)) {
+        line = line.trimmed();
+        if (!line.isEmpty()) {
+          tags.append(line);
+        }
+      }
+    }
+    provider = std::make_unique<QTagMemoryCompletionProvider>(tags);
+  }
+  return *provider;
+}
+
+QTagFileCompletionProvider::QTagFileCompletionProvider(const QString &path)
+    : impl{std::make_unique<Impl>()}
+{
+  impl->path = path;
+}
+
+QTagFileCompletionProvider::~QTagFileCompletionProvider() = default;
+
+QStringList QTagFileCompletionProvider::complete(
+    const QString &prefix, int limit, const Exclusion &exclude) const
+{
+  return impl->load().complete(prefix, limit, exclude);
+}
+
+QStringList QTagFileCompletionProvider::completeFuzzy(
+    const QString &pattern, int limit, const Exclusion &exclude) const
+{
+  return impl->load().completeFuzzy(pattern, limit, exclude);
+}
+
+QStringList QTagFileCompletionProvider::suggest(const QString &tag,
+                                               int limit) const
+{
+  return impl->load().suggest(tag, limit);
+}
+
+void QTagFileCompletionProvider::prepareSuggestions() const
+{
+  // Reading the file is part of the work that is kept off the caller
+  QThreadPool::globalInstance()->start([self = shared_from_this(), this]() {
+    impl->load().prepareSuggestions();
+  });
+}
+
+struct QTagMappedCompletionProvider::Impl {
+  QFile file{};
+  qsizetype count{0};
+  const uchar *offsets{nullptr};
+  const uchar *entries{nullptr};
+  quint64 entries_size{0};
+
+  bool map();
+  QByteArrayView entry(qsizetype position) const;
+  QString key(qsizetype position) const;
+  QString tag(qsizetype position) const;
+};
+
+bool QTagMappedCompletionProvider::Impl::map()
+{
+  if (!file.open(QIODevice::ReadOnly) ||
+      file.size() < kIndexHeaderSize + kIndexOffsetSize) {
+    return false;
+  }
+  const auto *data = file.map(0, file.size());
+  if (data == nullptr || qFromLittleEndian<quint32>(data) != kIndexMagic ||
+      qFromLittleEndian<quint32>(data + 4) != kIndexVersion) {
+    return false;
+  }
+  // Only the header is checked up front, so that opening stays O(1), entries
+  // are checked against the bounds of the file when they are read
+  const auto file_count = qFromLittleEndian<quint64>(data + 8);
+  const auto max_count = static_cast<quint64>(
+      (file.size() - kIndexHeaderSize) / kIndexOffsetSize - 1);
+  if (file_count > max_count) {
+    return false;
+  }
+  count = static_cast<qsizetype>(file_count);
+  offsets = data + kIndexHeaderSize;
+  entries = offsets + (count + 1) * kIndexOffsetSize;
+  entries_size = static_cast<quint64>(file.size() - (entries - data));
+  return true;
+}
+
+QByteArrayView QTagMappedCompletionProvider::Impl::entry(
+    qsizetype position) const
+{
+  const auto *offset = offsets + position * kIndexOffsetSize;
+  const auto begin = qFromLittleEndian<quint64>(offset);
+  const auto end = qFromLittleEndian<quint64>(offset + kIndexOffsetSize);
+  if (begin > end || end > entries_size) {
+    return {};
+  }
+  return {entries + begin, static_cast<qsizetype>(end - begin)};
+}
+
+QString QTagMappedCompletionProvider::Impl::key(qsizetype position) const
+{
+  const auto data = entry(position);
+  const auto separator = data.indexOf('\0');
+  return QString::fromUtf8(separator >= 0 ? data.first(separator) : data);
+}
+
+QString QTagMappedCompletionProvider::Impl::tag(qsizetype position) const
+{
+  const auto data = entry(position);
+  const auto separator = data.indexOf('\0');
+  return QString::fromUtf8(separator >= 0 ? data.sliced(separator + 1) : data);
+}
+
+QTagMappedCompletionProvider::QTagMappedCompletionProvider(
+    const QString &path)
+    : impl{std::make_unique<Impl>()}
+{
+  impl->file.setFileName(path);
+  if (!impl->map()) {
+    impl->count = 0;
+    impl->file.close();
+  }
+}
+
+QTagMappedCompletionProvider::~QTagMappedCompletionProvider() = default;
+
+bool QTagMappedCompletionProvider::isValid() const
+{
+  return impl->file.isOpen();
+}
+
+qsizetype QTagMappedCompletionProvider::size() const { return impl->count; }
+
+QStringList QTagMappedCompletionProvider::complete(
+    const QString &prefix, int limit, const Exclusion &exclude) const
+{
+  // The mapping is never changed after construction, so queries from any
+  // thread only read it
+  const auto folded = prefix.toCaseFolded();
+  const auto begin = partitionPoint(0, impl->count, [&](qsizetype position) {
+    return impl->key(position) < folded;
+  });
+  const auto end =
+      folded.isEmpty()
+          ? impl->count
+          : partitionPoint(begin, impl->count, [&](qsizetype position) {
+              return impl->key(position).startsWith(folded);
+            });
+
+  auto result = QStringList{};
+  for (auto position = begin; position < end && result.size() < limit;
+       ++position) {
+    auto tag = impl->tag(position);
+    if (!exclude || !exclude(tag)) {
+      result.append(std::move(tag));
+    }
+  }
+  return result;
+}
+
+bool QTagMappedCompletionProvider::writeIndex(const QTagCompletionIndex &index,
+                                              const QString &path)
+{
+  const auto count = index.size();
+  auto offsets = QByteArray{};
+  offsets.reserve(kIndexHeaderSize + (count + 1) * kIndexOffsetSize);
+  auto append = [&offsets](auto value) {
+    const auto little_endian = qToLittleEndian(value);
+    offsets.append(reinterpret_cast<const char *>(&little_endian),
+                   sizeof(little_endian));
+  };
+  append(kIndexMagic);
+  append(kIndexVersion);
+  append(static_cast<quint64>(count));
+
+  auto entries = QByteArray{};
+  for (qsizetype position = 0; position < count; ++position) {
+    const auto &tag = index.at(position);
+    append(static_cast<quint64>(entries.size()));
+    entries.append(tag.toCaseFolded().toUtf8());
+    entries.append('\0');
+    entries.append(tag.toUtf8());
+  }
+  append(static_cast<quint64>(entries.size()));
+
+  QSaveFile file(path);
+  if (!file.open(QIODevice::WriteOnly) || file.write(offsets) < 0 ||
+      file.write(entries) < 0) {
+    return false;
+  }
+  return file.commit();
+}
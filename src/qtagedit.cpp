@@ -14,21 +14,120 @@
 // along with this library.  If not, see <https://www.gnu.org/licenses/>.
 #include "qtagedit.hpp"
 
+#include "qtagcompletionprovider.hpp"
+#include "qtagusagestats.hpp"
+
+#include <QAbstractItemView>
 #include <QBrush>
 #include <QColor>
 #include <QCompleter>
+#include <QFontMetrics>
+#include <QFutureWatcher>
+#include <QHash>
 #include <QKeyEvent>
+#include <QMetaMethod>
 #include <QPainter>
-#include <QPainterPath>
+#include <QSet>
 #include <QRegularExpressionValidator>
+#include <QStringListModel>
 #include <QStyleOptionFrame>
 #include <QStylePainter>
+#include <QTimer>
 #include <algorithm>
+#include <array>
 #include <optional>
+#include <utility>
+#include <vector>
 
 struct QTagEdit::Impl {
   ~Impl() = default;
 
+  /// @brief Location of a single tag inside the text
+  struct TagSpan {
+    qsizetype offset;
+    qsizetype length;
+  };
+
+  /// @brief The tags of the current text as offsets into it
+  ///
+  /// The model is patched from the edit delta on every text change, so that
+  /// accessors and render paths never have to split the whole text.
+  struct TagModel {
+    QString text{};
+    std::vector<TagSpan> spans{};
+
+    // Occurrences of each tag, or of each property name if there is a
+    // separator, patched along with the spans
+    QHash<QString, int> counts{};
+    // Number of tags that repeat an earlier one
+    qsizetype duplicates{0};
+    std::optional<QChar> separator{};
+
+    // Tags removed and added since the changes were last taken, only
+    // collected while QTagEdit::tagsDiff is connected
+    bool record_changes{false};
+    QStringList added{};
+    QStringList removed{};
+
+    qsizetype size() const { return static_cast<qsizetype>(spans.size()); }
+    bool isEmpty() const { return spans.empty(); }
+
+    /// @brief Returns the tag at the given index without copying it
+    QString tag(qsizetype index) const
+    {
+      const auto &span = spans[index];
+      return QString::fromRawData(text.constData() + span.offset, span.length);
+    }
+
+    /// @brief Returns the index of the tag containing or ending at position,
+    /// -1 if there is none
+    qsizetype indexAt(qsizetype position) const
+    {
+      auto it = std::partition_point(
+          spans.begin(), spans.end(), [&](const TagSpan &span) {
+            return span.offset + span.length < position;
+          });
+      if (it == spans.end() || it->offset > position) {
+        return -1;
+      }
+      return it - spans.begin();
+    }
+
+    /// @brief Returns the part of a tag that identifies it
+    QStringView key(QStringView tag) const
+    {
+      if (separator) {
+        if (auto sep = tag.indexOf(*separator); sep >= 0) {
+          tag.truncate(sep);
+        }
+      }
+      return tag;
+    }
+
+    QStringView key(const TagSpan &span) const
+    {
+      return key(QStringView{text}.sliced(span.offset, span.length));
+    }
+
+    /// @brief Appends the spans of the tags in [begin, end) of text
+    static void split(const QString &text, qsizetype begin, qsizetype end,
+                      std::vector<TagSpan> &spans);
+
+    bool contains(QStringView key) const
+    {
+      return counts.contains(QString::fromRawData(key.data(), key.size()));
+    }
+
+    void count(const TagSpan &span, int delta);
+    /// @brief Counts and records a tag that is added or removed
+    void change(const TagSpan &span, int delta);
+    void setSeparator(QChar new_separator);
+    void update(const QString &new_text);
+
+    /// @brief Picks up tags appended to the text directly after position
+    void appended(qsizetype position);
+  };
+
   static constexpr int kLineEditLeftMargin{3};
 
   // Colors for tag brackgrounds
@@ -39,6 +138,9 @@ struct QTagEdit::Impl {
   static constexpr QColor kDarkColor{0, 0, 0};
   static constexpr QColor kBrightColor{245, 245, 245};
 
+  static constexpr QColor kDisabledTextColor{128, 128, 128};
+  static constexpr QColor kDisabledLineColor{211, 211, 211};
+
   static constexpr int kLeftMargin = 0;
   static constexpr int kTopMargin = 0;
   static constexpr int kRightMargin = 0;
@@ -71,17 +173,463 @@ struct QTagEdit::Impl {
 
   std::function<bool(const QString &)> tag_filter{};
 
-  bool unique_tags{true};
+  // Alternative to tag_filter, case folded if case insensitive
+  std::optional<QSet<QString>> valid_tags{};
+  Qt::CaseSensitivity valid_tags_sensitivity{Qt::CaseSensitive};
+
+  static constexpr qsizetype kMaxCachedFilterResults{4096};
+
+  // Results of tag_filter per distinct tag, until the filter is invalidated
+  QHash<QString, bool> filter_cache{};
+
+  Uniqueness uniqueness{Uniqueness::kSorted};
+  PropertyMerge property_merge{PropertyMerge::kKeepFirst};
+
+  bool mergesProperties() const
+  {
+    return separator && property_merge != PropertyMerge::kKeepFirst;
+  }
+
+  /// @brief Returns true if a tag must not be added, as its key is already
+  /// present or being added along with it
+  bool rejects(QStringView key, QSet<QStringView> &adding) const;
+
+  static constexpr int kDefaultCompletionLimit{100};
 
   std::unique_ptr<QCompleter> completer{nullptr};
+  // Only holds the current completions, owned by the completer
+  QStringListModel *completion_model{nullptr};
+  std::shared_ptr<const QTagCompletionProvider> completion_provider{};
+  // Completes the values of properties, keyed on the property name
+  QHash<QString, std::shared_ptr<const QTagCompletionProvider>>
+      value_providers{};
+  int completion_limit{kDefaultCompletionLimit};
+
+  /// @brief What is currently being completed
+  struct CompletionContext {
+    /// @brief The span of the text replaced by a completion
+    qsizetype begin{0};
+    qsizetype end{0};
+    QString prefix{};
+    std::shared_ptr<const QTagCompletionProvider> provider{};
+    bool is_value{false};
+  };
+
+  CompletionContext completion{};
+
+  // Asynchronous completion, queries run on the global thread pool once
+  // typing paused for the timer's interval
+  bool async_completion{false};
+  bool fuzzy_completion{false};
+  QTimer async_timer{};
+  QFutureWatcher<QStringList> async_watcher{};
+
+  std::shared_ptr<QTagUsageStats> usage_stats{};
+  // Tags touched by the user since editing last finished
+  QSet<QString> edited_tags{};
+
+  TagModel tags{};
+
+  // Nesting depth of beginUpdate(), while positive the text only changes in
+  // the tag model
+  int update_depth{0};
+  bool text_pending{false};
+  // Properties were added that may have to be merged into existing ones
+  bool merge_pending{false};
+
+  // Text being built by QTagEdit::beginAppend() outside of a batch
+  QString append_buffer{};
+  qsizetype append_position{0};
+
+  /// @brief Returns the length of a property written as a tag
+  qsizetype tagSize(const Property &property) const;
+
+  /// @brief Appends a tag to text, separated from the previous one
+  static void appendTag(QString &text, QStringView tag);
+
+  /// @brief Appends a property written as a tag to text
+  void appendTag(QString &text, const Property &property) const;
+
+  QTagCompletionProvider::Exclusion completionExclusion() const;
+
+  /// @brief Lets the completion provider prepare suggestions if there is a
+  /// filter they could correct misspelled tags for
+  void prepareSuggestions() const;
+
+  /// @brief Returns true if the completion may turn out to be a misspelled
+  /// tag, without calling the filter
+  bool canSuggest() const;
+
+  /// @brief Checks a tag against the filter, bypassing the cache
+  bool matchesFilter(const QString &tag) const;
+
+  /// @brief Cached text widths of a single tag
+  struct TagMetrics {
+    /// @brief Length of the tag up to the first property separator
+    qsizetype name_length;
+    int width;
+    int name_width;
+    int property_width;
+    /// @brief Width of the tag including the following space
+    int advance;
+  };
+
+  static constexpr qsizetype kMaxCachedMetrics{4096};
+
+  // Keyed on the tag, only valid for the current font, separator and device
+  // pixel ratio
+  QHash<QString, TagMetrics> metrics{};
+  qreal metrics_dpr{0};
+
+  TagMetrics metricsFor(const QString &tag, const QFontMetrics &font_metrics);
+
+  enum StyleClass { kPrimaryStyle, kSecondaryStyle, kStyleClassCount };
+
+  const Style &styleFor(StyleClass style_class) const
+  {
+    return style_class == kPrimaryStyle ? primary : secondary;
+  }
+
+  /// @brief Geometry and style of a single tag, computed once per paint
+  struct TagLayout {
+    qsizetype index;
+    StyleClass style_class;
+    bool has_property;
+    QRect text_rect;
+    QRect shade_rect;
+    QRect property_rect;
+    QLine underline;
+  };
+
+  /// @brief Geometry of all tags sharing a style, filled in one go
+  struct RenderBatch {
+    QList<QRect> shades;
+    QList<QRect> properties;
+    QList<QLine> underlines;
+  };
+
+  /// @brief Pens derived from a style
+  struct StylePens {
+    QPen text;
+    QPen line;
+  };
+
+  // Updated whenever the colors or the enabled state change, so that painting
+  // only has to look them up
+  std::array<StylePens, kStyleClassCount> pens{};
+
+  // Reused between paints to avoid reallocating
+  std::vector<TagLayout> layouts{};
+  std::array<RenderBatch, kStyleClassCount> batches{};
 };
 
+void QTagEdit::Impl::TagModel::split(const QString &text, qsizetype begin,
+                                     qsizetype end,
+                                     std::vector<TagSpan> &spans)
+{
+  for (auto pos = begin; pos < end;) {
+    if (text[pos] == ' ') {
+      ++pos;
+      continue;
+    }
+    auto tag_end = text.indexOf(' ', pos);
+    if (tag_end < 0 || tag_end > end) {
+      tag_end = end;
+    }
+    spans.push_back({.offset = pos, .length = tag_end - pos});
+    pos = tag_end;
+  }
+}
+
+void QTagEdit::Impl::TagModel::count(const TagSpan &span, int delta)
+{
+  const auto key = this->key(span);
+  auto it = counts.find(QString::fromRawData(key.data(), key.size()));
+  const auto before = it == counts.end() ? 0 : *it;
+  const auto after = before + delta;
+  // Every occurrence but the first one is a duplicate
+  duplicates += std::max(after, 1) - std::max(before, 1);
+  if (it == counts.end()) {
+    if (after > 0) {
+      counts.insert(key.toString(), after);
+    }
+  } else if (after <= 0) {
+    counts.erase(it);
+  } else {
+    *it = after;
+  }
+}
+
+void QTagEdit::Impl::TagModel::change(const TagSpan &span, int delta)
+{
+  count(span, delta);
+  if (record_changes) {
+    // The text changes after this, so the tag has to be copied
+    (delta > 0 ? added : removed)
+        .append(QStringView{text}.sliced(span.offset, span.length).toString());
+  }
+}
+
+void QTagEdit::Impl::TagModel::setSeparator(QChar new_separator)
+{
+  separator = new_separator;
+  counts.clear();
+  duplicates = 0;
+  for (const auto &span : spans) {
+    count(span, 1);
+  }
+}
+
+void QTagEdit::Impl::TagModel::update(const QString &new_text)
+{
+  if (new_text == text) {
+    return;
+  }
+  const auto old_size = text.size();
+  const auto new_size = new_text.size();
+  const auto common_size = std::min(old_size, new_size);
+
+  // Narrow the edit down to the range that actually differs
+  qsizetype prefix = 0;
+  while (prefix < common_size && text[prefix] == new_text[prefix]) {
+    ++prefix;
+  }
+  qsizetype suffix = 0;
+  while (suffix < common_size - prefix &&
+         text[old_size - 1 - suffix] == new_text[new_size - 1 - suffix]) {
+    ++suffix;
+  }
+
+  // Widen it to whole tags, as the edit may have split or merged its
+  // neighbours. Both ends lie in the unchanged parts, so they are tag
+  // boundaries in the old text as well. A neighbour is left alone if the
+  // edit ends at a space or the end of the text on both sides, so that it
+  // is not reported as changed.
+  auto is_boundary = [](const QString &string, qsizetype position) {
+    return position == string.size() || string[position] == ' ';
+  };
+  auto begin = prefix;
+  if (!is_boundary(text, prefix) || !is_boundary(new_text, prefix)) {
+    while (begin > 0 && new_text[begin - 1] != ' ') {
+      --begin;
+    }
+  }
+  auto is_boundary_before = [](const QString &string, qsizetype position) {
+    return position == 0 || string[position - 1] == ' ';
+  };
+  auto new_end = new_size - suffix;
+  if (!is_boundary_before(text, old_size - suffix) ||
+      !is_boundary_before(new_text, new_end)) {
+    while (new_end < new_size && new_text[new_end] != ' ') {
+      ++new_end;
+    }
+  }
+  const auto delta = new_size - old_size;
+  const auto old_end = new_end - delta;
+
+  auto by_offset = [](const TagSpan &span, qsizetype offset) {
+    return span.offset < offset;
+  };
+  auto first = std::lower_bound(spans.begin(), spans.end(), begin, by_offset);
+  auto last = std::lower_bound(first, spans.end(), old_end, by_offset);
+
+  std::vector<TagSpan> replacement;
+  split(new_text, begin, new_end, replacement);
+
+  for (auto it = first; it != last; ++it) {
+    change(*it, -1);
+  }
+  for (auto it = last; it != spans.end(); ++it) {
+    it->offset += delta;
+  }
+  first = spans.erase(first, last);
+  spans.insert(first, replacement.begin(), replacement.end());
+
+  text = new_text;
+  for (const auto &span : replacement) {
+    change(span, 1);
+  }
+}
+
+void QTagEdit::Impl::TagModel::appended(qsizetype position)
+{
+  // The last tag may have been extended, so split it again
+  if (!spans.empty() &&
+      spans.back().offset + spans.back().length == position &&
+      position < text.size() && text[position] != ' ') {
+    position = spans.back().offset;
+    // Only the extended tag counts as removed, not what was appended to it
+    const auto old_tag =
+        QStringView{text}.sliced(position, spans.back().length).toString();
+    count(spans.back(), -1);
+    if (record_changes) {
+      removed.append(old_tag);
+    }
+    spans.pop_back();
+  }
+  const auto first = spans.size();
+  split(text, position, text.size(), spans);
+  for (auto i = first; i < spans.size(); ++i) {
+    change(spans[i], 1);
+  }
+}
+
+bool QTagEdit::Impl::rejects(QStringView key,
+                             QSet<QStringView> &adding) const
+{
+  if (uniqueness != Uniqueness::kOrdered) {
+    return false;
+  }
+  if (tags.contains(key) || adding.contains(key)) {
+    return true;
+  }
+  adding.insert(key);
+  return false;
+}
+
+qsizetype QTagEdit::Impl::tagSize(const Property &property) const
+{
+  auto size = property.name.size();
+  if (separator) {
+    for (const auto &value : property.values) {
+      size += 1 + value.size();
+    }
+  }
+  return size;
+}
+
+void QTagEdit::Impl::appendTag(QString &text, QStringView tag)
+{
+  if (!text.isEmpty()) {
+    text += u' ';
+  }
+  text += tag;
+}
+
+void QTagEdit::Impl::appendTag(QString &text, const Property &property) const
+{
+  appendTag(text, property.name);
+  if (const auto &sep = separator) {
+    for (const auto &value : property.values) {
+      text += *sep;
+      text += value;
+    }
+  }
+}
+
+QTagCompletionProvider::Exclusion QTagEdit::Impl::completionExclusion() const
+{
+  if (uniqueness == Uniqueness::kNone || completion.is_value) {
+    return {};
+  }
+  // The tag being completed is in the text already, it does not count
+  auto own = QString{};
+  if (const auto index = tags.indexAt(completion.begin);
+      completion.begin < completion.end && index >= 0 &&
+      tags.spans[index].offset == completion.begin) {
+    own = tags.key(tags.spans[index]).toString();
+  }
+  // The counts are shared, not copied, but a query still running on another
+  // thread keeps its own version when the text changes
+  return [counts = tags.counts, own = std::move(own)](const QString &tag) {
+    return counts.value(tag) > (tag == own ? 1 : 0);
+  };
+}
+
+void QTagEdit::Impl::prepareSuggestions() const
+{
+  if (completion_provider != nullptr && (tag_filter || valid_tags)) {
+    completion_provider->prepareSuggestions();
+  }
+}
+
+bool QTagEdit::Impl::canSuggest() const
+{
+  return !completion.is_value && !completion.prefix.isEmpty() &&
+         (tag_filter || valid_tags);
+}
+
+bool QTagEdit::Impl::matchesFilter(const QString &tag) const
+{
+  if (valid_tags) {
+    return valid_tags->contains(valid_tags_sensitivity == Qt::CaseSensitive
+                                    ? tag
+                                    : tag.toCaseFolded());
+  }
+  return !tag_filter || tag_filter(tag);
+}
+
+QTagEdit::Impl::TagMetrics QTagEdit::Impl::metricsFor(
+    const QString &tag, const QFontMetrics &font_metrics)
+{
+  if (auto it = metrics.constFind(tag); it != metrics.cend()) {
+    return *it;
+  }
+  if (metrics.size() >= kMaxCachedMetrics) {
+    metrics.clear();
+  }
+
+  auto name_length = tag.size();
+  if (separator) {
+    auto first_sep = tag.indexOf(*separator);
+    if (first_sep >= 0) {
+      name_length = first_sep;
+    }
+  }
+  const auto result = TagMetrics{
+      .name_length = name_length,
+      .width = font_metrics.horizontalAdvance(tag),
+      .name_width = font_metrics.horizontalAdvance(tag.first(name_length)),
+      .property_width =
+          font_metrics.horizontalAdvance(tag.sliced(name_length)),
+      .advance = font_metrics.horizontalAdvance(tag + " ")};
+  // The tag may be raw data pointing into the text, so store a deep copy
+  metrics.insert(QString{tag.constData(), tag.size()}, result);
+  return result;
+}
+
 QTagEdit::QTagEdit(QWidget *parent)
     : QLineEdit(parent), impl{std::make_unique<Impl>()}
 {
+  // Keep the tag model in sync before anyone is told about the change. User
+  // edits emit textEdited before textChanged, the second update then finds
+  // the model unchanged.
+  auto update_tags = [this](const QString &text) { impl->tags.update(text); };
+  connect(this, &QLineEdit::textEdited, this, update_tags);
+  connect(this, &QLineEdit::textChanged, this, update_tags);
   connect(this, &QLineEdit::textChanged, this, &QTagEdit::tagsChanged);
+  connect(this, &QLineEdit::textChanged, this, &QTagEdit::emitTagsDiff);
   connect(this, &QLineEdit::textEdited, this, &QTagEdit::tagsEdited);
   connect(this, &QLineEdit::editingFinished, this, &QTagEdit::makeTagsUnique);
+  // Runs after the model was patched for the edit
+  connect(this, &QLineEdit::textEdited, this, [this]() {
+    if (impl->usage_stats != nullptr) {
+      auto index = impl->tags.indexAt(cursorPosition());
+      if (index >= 0) {
+        const auto tag = impl->tags.tag(index);
+        impl->edited_tags.insert(QString{tag.constData(), tag.size()});
+      }
+    }
+  });
+  connect(this, &QLineEdit::editingFinished, this,
+          &QTagEdit::recordEditedTags);
+
+  updatePens();
+
+  impl->async_timer.setSingleShot(true);
+  connect(&impl->async_timer, &QTimer::timeout, this,
+          &QTagEdit::startAsyncCompletion);
+  connect(&impl->async_watcher, &QFutureWatcherBase::finished, this, [this]() {
+    const auto future = impl->async_watcher.future();
+    if (future.isCanceled() || future.resultCount() == 0) {
+      return;
+    }
+    // A second result holds the suggestions in case nothing matched, they
+    // are only offered if the tag is not valid itself
+    showCompletions(future.resultCount() > 1 && wantsSuggestions()
+                        ? validSuggestions(future.resultAt(1))
+                        : future.resultAt(0));
+  });
 
   // Only allow a single whitespace between tags
   this->setValidator(
@@ -90,79 +638,274 @@ QTagEdit::QTagEdit(QWidget *parent)
 
 QTagEdit::~QTagEdit() {}
 
-void QTagEdit::setTags(const QStringList &tags) { setText(tags.join(" ")); }
+void QTagEdit::setTags(const QStringList &tags) { commitText(tags.join(" ")); }
 
 void QTagEdit::setTagsForCompletion(const QStringList &tags)
 {
-  impl->completer = std::make_unique<QCompleter>(tags);
-  impl->completer->setCaseSensitivity(Qt::CaseInsensitive);
+  setCompletionProvider(std::make_shared<QTagMemoryCompletionProvider>(tags));
+}
+
+void QTagEdit::setTagsForCompletion(const QTagCompletionIndex &index)
+{
+  setCompletionProvider(std::make_shared<QTagMemoryCompletionProvider>(index));
+}
+
+bool QTagEdit::setTagsForCompletionFromIndex(const QString &path)
+{
+  auto provider = std::make_shared<QTagMappedCompletionProvider>(path);
+  if (!provider->isValid()) {
+    return false;
+  }
+  setCompletionProvider(std::move(provider));
+  return true;
+}
+
+void QTagEdit::setCompletionProvider(
+    std::shared_ptr<const QTagCompletionProvider> provider)
+{
+  impl->completion_provider = std::move(provider);
+  impl->async_timer.stop();
+  impl->async_watcher.cancel();
+  impl->prepareSuggestions();
+}
+
+void QTagEdit::setValuesForCompletion(const QString &property,
+                                      const QStringList &values)
+{
+  setValueCompletionProvider(
+      property, std::make_shared<QTagMemoryCompletionProvider>(values));
+}
+
+void QTagEdit::setValueCompletionProvider(
+    const QString &property,
+    std::shared_ptr<const QTagCompletionProvider> provider)
+{
+  if (provider == nullptr) {
+    impl->value_providers.remove(property);
+  } else {
+    impl->value_providers.insert(property, std::move(provider));
+  }
+  impl->async_timer.stop();
+  impl->async_watcher.cancel();
+}
+
+void QTagEdit::ensureCompleter()
+{
+  // Created on first use, so that forms with many fields do not pay for
+  // completers that are never shown
+  if (impl->completer != nullptr) {
+    return;
+  }
+  impl->completer = std::make_unique<QCompleter>();
+  impl->completion_model = new QStringListModel(impl->completer.get());
+  impl->completer->setModel(impl->completion_model);
+  // The provider already did the matching
+  impl->completer->setCompletionMode(QCompleter::UnfilteredPopupCompletion);
   impl->completer->setWidget(this);
   connect(impl->completer.get(),
           QOverload<const QString &>::of(&QCompleter::activated), this,
-          [this](QString const &text) {
-            removeLastTag();
-            addTag(text);
-          });
+          [this](QString const &text) { insertCompletion(text); });
 }
 
 QStringList QTagEdit::getTags() const
 {
-  return text().split(" ", Qt::SkipEmptyParts);
+  const auto &model = impl->tags;
+  auto tags = QStringList{};
+  tags.reserve(model.size());
+  for (const auto &span : model.spans) {
+    tags.append(model.text.sliced(span.offset, span.length));
+  }
+  return tags;
+}
+
+qsizetype QTagEdit::tagCount() const { return impl->tags.size(); }
+
+QStringView QTagEdit::tagView(qsizetype index) const
+{
+  const auto &span = impl->tags.spans[index];
+  return QStringView{impl->tags.text}.sliced(span.offset, span.length);
 }
 
 void QTagEdit::addTag(const QString &tag)
 {
-  if (this->text().isEmpty()) {
-    this->setText(tag);
-  } else {
-    this->setText(this->text() + " " + tag);
+  auto adding = QSet<QStringView>{};
+  if (impl->rejects(impl->tags.key(tag), adding)) {
+    return;
   }
+  if (impl->usage_stats != nullptr) {
+    impl->usage_stats->record(tag);
+  }
+  auto &text = beginAppend(tag.size());
+  Impl::appendTag(text, tag);
+  endAppend();
+}
+
+void QTagEdit::addTags(const QStringList &tags)
+{
+  if (tags.isEmpty()) {
+    return;
+  }
+  auto size = qsizetype{0};
+  for (const auto &tag : tags) {
+    size += tag.size() + 1;
+  }
+  auto adding = QSet<QStringView>{};
+  auto &text = beginAppend(size);
+  for (const auto &tag : tags) {
+    if (impl->rejects(impl->tags.key(tag), adding)) {
+      continue;
+    }
+    if (impl->usage_stats != nullptr) {
+      impl->usage_stats->record(tag);
+    }
+    Impl::appendTag(text, tag);
+  }
+  endAppend();
 }
 
 void QTagEdit::removeLastTag()
 {
-  auto text = this->text();
+  auto text = impl->tags.text;
   auto index = text.lastIndexOf(' ');
   if (index >= 0) {
     text.truncate(index);
-    this->setText(text);
+    commitText(text);
   } else {
-    this->setText("");
+    commitText("");
   }
 }
 
 void QTagEdit::setProperties(const PropertyList &properties)
 {
-  auto tags = QStringList{};
+  auto size = qsizetype{0};
   for (const auto &property : properties) {
-    tags.append(property.name);
-    if (auto sep = impl->separator) {
-      for (const auto &value : property.values) {
-        tags.last() += *sep + value;
-      }
-    }
+    size += impl->tagSize(property) + 1;
+  }
+  auto text = QString{};
+  text.reserve(size);
+  for (const auto &property : properties) {
+    impl->appendTag(text, property);
   }
-  setTags(tags);
+  commitText(text);
 }
 
 void QTagEdit::addProperty(const Property &property)
 {
-  QString tag = property.name;
-  if (const auto &sep = impl->separator) {
-    for (const auto &value : property.values) {
-      tag += *sep + value;
+  auto adding = QSet<QStringView>{};
+  if (!impl->mergesProperties() && impl->rejects(property.name, adding)) {
+    return;
+  }
+  UpdateGuard guard{*this};
+  auto &text = beginAppend(impl->tagSize(property));
+  impl->appendTag(text, property);
+  endAppend();
+  mergeAddedProperties();
+}
+
+void QTagEdit::addProperties(const PropertyList &properties)
+{
+  if (properties.isEmpty()) {
+    return;
+  }
+  auto size = qsizetype{0};
+  for (const auto &property : properties) {
+    size += impl->tagSize(property) + 1;
+  }
+  auto adding = QSet<QStringView>{};
+  UpdateGuard guard{*this};
+  auto &text = beginAppend(size);
+  for (const auto &property : properties) {
+    if (impl->mergesProperties() || !impl->rejects(property.name, adding)) {
+      impl->appendTag(text, property);
+    }
+  }
+  endAppend();
+  mergeAddedProperties();
+}
+
+void QTagEdit::mergeAddedProperties()
+{
+  // Merged once at the end of the batch, so that there is a single change
+  // and adding properties one by one stays linear
+  if (impl->uniqueness == Uniqueness::kOrdered && impl->mergesProperties()) {
+    impl->merge_pending = true;
+  }
+}
+
+QString &QTagEdit::beginAppend(qsizetype size)
+{
+  auto &text = impl->tags.text;
+  impl->append_position = text.size();
+  const auto needed = text.size() + size + 1;
+  if (impl->update_depth > 0) {
+    // Grow geometrically, so that adding tags one by one stays linear
+    if (needed > text.capacity()) {
+      text.reserve(std::max(needed, 2 * text.capacity()));
     }
+    return text;
+  }
+  impl->append_buffer.reserve(needed);
+  impl->append_buffer += text;
+  return impl->append_buffer;
+}
+
+void QTagEdit::endAppend()
+{
+  if (impl->update_depth > 0) {
+    impl->tags.appended(impl->append_position);
+    impl->text_pending = true;
+  } else {
+    setText(std::exchange(impl->append_buffer, {}));
+  }
+}
+
+void QTagEdit::beginUpdate() { ++impl->update_depth; }
+
+void QTagEdit::endUpdate()
+{
+  if (impl->update_depth == 0) {
+    return;
+  }
+  if (impl->update_depth == 1 && impl->merge_pending) {
+    impl->merge_pending = false;
+    if (impl->tags.duplicates > 0) {
+      mergeProperties(false);
+    }
+  }
+  if (--impl->update_depth > 0) {
+    return;
+  }
+  if (impl->text_pending) {
+    impl->text_pending = false;
+    if (impl->tags.text == text()) {
+      // Nothing to report, as the batch undid its own changes
+      impl->tags.added.clear();
+      impl->tags.removed.clear();
+    } else {
+      setText(impl->tags.text);
+    }
+  }
+}
+
+void QTagEdit::commitText(const QString &text)
+{
+  if (impl->update_depth > 0) {
+    // Keeps the getters up to date, setText() at the end of the batch then
+    // finds the model unchanged
+    impl->tags.update(text);
+    impl->text_pending = true;
+  } else {
+    setText(text);
   }
-  this->setText(this->text() + " " + tag);
 }
 
 QTagEdit::PropertyList QTagEdit::getProperties() const
 {
   auto list = PropertyList{};
-  auto tags = getTags();
-  for (const auto &tag : tags) {
+  const auto &model = impl->tags;
+  for (qsizetype i = 0; i < model.size(); ++i) {
     if (auto sep = impl->separator) {
-      auto tokens = tag.split(*sep);
+      auto tokens = model.tag(i).split(*sep);
       if (tokens.size() > 1) {
         list.append({.name = tokens[0], .values = tokens.mid(1)});
       } else {
@@ -173,12 +916,29 @@ QTagEdit::PropertyList QTagEdit::getProperties() const
   return list;
 }
 
+QTagEdit::PropertyView QTagEdit::propertyView(qsizetype index) const
+{
+  const auto tag = tagView(index);
+  auto view = PropertyView{.name = tag};
+  if (auto sep = impl->separator) {
+    view.separator = *sep;
+    auto first_sep = tag.indexOf(*sep);
+    if (first_sep >= 0) {
+      view.name = tag.first(first_sep);
+      view.values = tag.sliced(first_sep + 1);
+      view.has_values = true;
+    }
+  }
+  return view;
+}
+
 void QTagEdit::setColors(const QColor &line_color, const QColor &shade_color,
                          const QColor &property_color)
 {
   impl->primary.line_color = line_color;
   impl->primary.shade_color = shade_color;
   impl->primary.property_color = property_color;
+  updatePens();
 }
 
 void QTagEdit::setSecondaryColors(const QColor &line_color,
@@ -188,19 +948,111 @@ void QTagEdit::setSecondaryColors(const QColor &line_color,
   impl->secondary.line_color = line_color;
   impl->secondary.shade_color = shade_color;
   impl->secondary.property_color = property_color;
+  updatePens();
+}
+
+void QTagEdit::setAsyncCompletion(bool async, int delay_ms)
+{
+  impl->async_completion = async;
+  impl->async_timer.setInterval(delay_ms);
+  if (!async) {
+    impl->async_timer.stop();
+    impl->async_watcher.cancel();
+  }
+}
+
+void QTagEdit::setUsageStats(std::shared_ptr<QTagUsageStats> stats)
+{
+  impl->usage_stats = std::move(stats);
+  impl->edited_tags.clear();
+}
+
+void QTagEdit::recordEditedTags()
+{
+  if (impl->usage_stats == nullptr || impl->edited_tags.isEmpty()) {
+    return;
+  }
+  // Only tags that survived editing count, not the prefixes typed on the way
+  for (qsizetype i = 0; i < impl->tags.size(); ++i) {
+    const auto tag = impl->tags.tag(i);
+    if (impl->edited_tags.remove(tag)) {
+      // The stats keep the tag, which is raw data pointing into the text
+      impl->usage_stats->record(QString{tag.constData(), tag.size()});
+    }
+  }
+  impl->edited_tags.clear();
+}
+
+void QTagEdit::setFuzzyCompletion(bool fuzzy)
+{
+  impl->fuzzy_completion = fuzzy;
+}
+
+void QTagEdit::setCompletionLimit(int limit)
+{
+  impl->completion_limit = std::max(limit, 1);
 }
 
 void QTagEdit::setTagFilter(std::function<bool(const QString &)> filter)
 {
   impl->tag_filter = std::move(filter);
+  impl->valid_tags.reset();
+  impl->prepareSuggestions();
+  invalidateTagFilter();
+}
+
+void QTagEdit::setValidTags(const QSet<QString> &tags,
+                            Qt::CaseSensitivity sensitivity)
+{
+  if (sensitivity == Qt::CaseSensitive) {
+    impl->valid_tags = tags;
+  } else {
+    auto folded = QSet<QString>{};
+    folded.reserve(tags.size());
+    for (const auto &tag : tags) {
+      folded.insert(tag.toCaseFolded());
+    }
+    impl->valid_tags = std::move(folded);
+  }
+  impl->valid_tags_sensitivity = sensitivity;
+  impl->tag_filter = nullptr;
+  impl->prepareSuggestions();
+  invalidateTagFilter();
+}
+
+void QTagEdit::invalidateTagFilter()
+{
+  impl->filter_cache.clear();
+  update();
+}
+
+void QTagEdit::invalidateTagFilter(const QString &tag)
+{
+  impl->filter_cache.remove(tag);
+  update();
 }
 
 void QTagEdit::setPropertySeparator(QChar separator)
 {
   impl->separator = separator;
+  impl->tags.setSeparator(separator);
+  impl->metrics.clear();
+}
+
+void QTagEdit::setUniqueTags(bool unique)
+{
+  setUniqueTags(unique ? Uniqueness::kSorted : Uniqueness::kNone);
+}
+
+void QTagEdit::setUniqueTags(Uniqueness uniqueness)
+{
+  impl->uniqueness = uniqueness;
 }
 
-void QTagEdit::setUniqueTags(bool unique) { impl->unique_tags = unique; }
+void QTagEdit::setPropertyMerge(PropertyMerge merge)
+{
+  impl->property_merge = merge;
+}
 
 QSize QTagEdit::sizeHint() const
 {
@@ -240,19 +1092,25 @@ void QTagEdit::paintEvent(QPaintEvent *event)
       style()->subElementRect(QStyle::SE_LineEditContents, &text_frame, this);
   content_rect.translate(impl->kLineEditLeftMargin, 0);
 
+  if (devicePixelRatioF() != impl->metrics_dpr) {
+    impl->metrics.clear();
+    impl->metrics_dpr = devicePixelRatioF();
+  }
+
   if (hasFocus()) {
     QLineEdit::paintEvent(event);
 
     QStylePainter painter(this);
     painter.setRenderHint(QPainter::Antialiasing);
-    renderTagBackgrounds(painter, content_rect, true);
+    layoutTags(content_rect);
+    renderTags(painter, true);
   } else {
     QStylePainter painter(this);
     painter.setRenderHint(QPainter::Antialiasing);
     painter.drawPrimitive(QStyle::PE_PanelLineEdit, text_frame);
     painter.drawPrimitive(QStyle::PE_FrameLineEdit, focus_rect);
-    renderTagBackgrounds(painter, content_rect, false);
-    renderTags(painter, content_rect);
+    layoutTags(content_rect);
+    renderTags(painter, false);
   }
 }
 
@@ -260,93 +1118,349 @@ void QTagEdit::keyPressEvent(QKeyEvent *event)
 {
   QLineEdit::keyPressEvent(event);
 
-  if (impl->completer != nullptr) {
-    if (this->text().isEmpty() || this->text().back() == ' ') {
-      impl->completer->setCompletionPrefix("");
-      impl->completer->complete();
-    } else {
-      auto tags = getTags();
-      if (!tags.isEmpty()) {
-        const auto &last_tag = tags.back();
-        impl->completer->setCompletionPrefix(last_tag);
-        impl->completer->complete();
-      }
+  if (impl->completion_provider != nullptr ||
+      !impl->value_providers.isEmpty()) {
+    ensureCompleter();
+    updateCompletions();
+  }
+}
+
+void QTagEdit::updateCompletions()
+{
+  // Complete the tag the cursor is in or right behind, from its start up to
+  // the cursor, or start a new one if there is none
+  const auto cursor = cursorPosition();
+  auto context = Impl::CompletionContext{.begin = cursor,
+                                         .end = cursor,
+                                         .provider = impl->completion_provider};
+  const auto index = impl->tags.indexAt(cursor);
+  if (index >= 0 && impl->tags.spans[index].offset < cursor) {
+    const auto &span = impl->tags.spans[index];
+    context.begin = span.offset;
+    context.end = span.offset + span.length;
+  }
+  const auto token = QStringView{impl->tags.text}.sliced(
+      context.begin, context.end - context.begin);
+
+  // After a separator only the values of that property are completed, only
+  // the value around the cursor is replaced. Before it only the name is, so
+  // that the values are kept.
+  if (const auto &sep = impl->separator) {
+    const auto typed = token.first(cursor - context.begin);
+    const auto first_sep = token.indexOf(*sep);
+    const auto last_sep = typed.lastIndexOf(*sep);
+    if (last_sep >= 0) {
+      const auto name = token.first(first_sep).toString();
+      context.provider = impl->value_providers.value(name);
+      const auto next_sep = token.indexOf(*sep, typed.size());
+      context.end = next_sep >= 0 ? context.begin + next_sep : context.end;
+      context.begin += last_sep + 1;
+      context.is_value = true;
+    } else if (first_sep >= 0) {
+      context.end = context.begin + first_sep;
     }
   }
+  context.prefix =
+      impl->tags.text.sliced(context.begin, cursor - context.begin);
+  impl->completion = std::move(context);
+
+  // Results of a query still in flight are stale now
+  impl->async_timer.stop();
+  impl->async_watcher.cancel();
+  const auto &provider = impl->completion.provider;
+  if (provider == nullptr) {
+    impl->completer->popup()->hide();
+  } else if (impl->async_completion) {
+    impl->async_timer.start();
+  } else {
+    const auto &prefix = impl->completion.prefix;
+    auto completions =
+        impl->fuzzy_completion
+            ? provider->completeFuzzy(prefix, impl->completion_limit,
+                                      impl->completionExclusion())
+            : provider->complete(prefix, impl->completion_limit,
+                                 impl->completionExclusion());
+    const auto missed = completions.isEmpty();
+    showCompletions(std::move(completions));
+    if (missed && impl->canSuggest()) {
+      // Finding suggestions takes longer, so they are looked up like
+      // asynchronous completions and shown once they are there
+      startAsyncCompletion();
+    }
+  }
+}
+
+void QTagEdit::startAsyncCompletion()
+{
+  const auto &completion = impl->completion;
+  const auto matching = impl->fuzzy_completion
+                            ? QTagCompletionProvider::Matching::kFuzzy
+                            : QTagCompletionProvider::Matching::kPrefix;
+  impl->async_watcher.setFuture(completion.provider->completeAsync(
+      completion.prefix, impl->completion_limit, matching,
+      impl->completionExclusion(), impl->canSuggest()));
 }
 
-void QTagEdit::renderTags(QStylePainter &painter, QRect rect)
+void QTagEdit::insertCompletion(const QString &completion)
 {
-  for (const auto &tag : getTags()) {
-    this->ensurePolished();
+  const auto &context = impl->completion;
+  const auto &text = impl->tags.text;
+  const auto begin = std::min(context.begin, text.size());
+  const auto end = std::clamp(context.end, begin, text.size());
 
-    auto pen = Filter(tag) ? getPenForColor(impl->primary.property_color)
-                           : getPenForColor(impl->secondary.property_color);
-    if (!this->isEnabled()) {
-      pen.setColor(QColor("gray"));
+  // A new tag needs to be separated from its neighbours
+  auto replacement = completion;
+  if (begin == end && !context.is_value) {
+    if (begin > 0 && text[begin - 1] != ' ') {
+      replacement.prepend(u' ');
     }
-    painter.setPen(pen);
-    painter.drawText(rect, Qt::AlignVCenter, tag);
+    if (end < text.size() && text[end] != ' ') {
+      replacement.append(u' ');
+    }
+  }
+  // Edit in place, which leaves the other tags alone and can be undone
+  setSelection(begin, end - begin);
+  // Inserting counts as an edit, so the tag is recorded with the others once
+  // editing finished
+  insert(replacement);
+}
 
-    rect.moveLeft(rect.left() + fontMetrics().horizontalAdvance(tag + " "));
+QStringList QTagEdit::suggestTags(const QString &tag, int limit)
+{
+  if (impl->completion_provider == nullptr) {
+    return {};
   }
+  return validSuggestions(impl->completion_provider->suggest(tag, limit));
 }
 
-void QTagEdit::renderTagBackgrounds(QStylePainter &painter, QRect rect,
-                                    bool line_only)
+bool QTagEdit::wantsSuggestions()
 {
+  // Nothing starts with a tag that is not valid, so it is probably misspelled.
+  // Prefixes are not cached, they would only evict the tags in the text.
+  return impl->canSuggest() && !impl->matchesFilter(impl->completion.prefix);
+}
+
+QStringList QTagEdit::validSuggestions(QStringList suggestions)
+{
+  suggestions.removeIf(
+      [this](const QString &suggestion) { return !Filter(suggestion); });
+  return suggestions;
+}
+
+void QTagEdit::showCompletions(QStringList completions)
+{
+  if (impl->usage_stats != nullptr && !impl->completion.is_value) {
+    // Frequently used tags first, the rest in the provider's order. Only the
+    // provider's candidates are ranked, so the stats never bring in tags
+    // outside the vocabulary, like a typo that was accepted once.
+    auto scored = std::vector<std::pair<double, qsizetype>>{};
+    scored.reserve(completions.size());
+    for (qsizetype i = 0; i < completions.size(); ++i) {
+      scored.emplace_back(-impl->usage_stats->score(completions[i]), i);
+    }
+    std::sort(scored.begin(), scored.end());
+    auto ranked = QStringList{};
+    ranked.reserve(completions.size());
+    for (const auto &[score, i] : scored) {
+      ranked.append(completions[i]);
+    }
+    impl->completion_model->setStringList(ranked);
+  } else {
+    impl->completion_model->setStringList(completions);
+  }
+  if (impl->completion_model->rowCount() == 0) {
+    impl->completer->popup()->hide();
+  } else {
+    impl->completer->complete();
+  }
+}
+
+void QTagEdit::changeEvent(QEvent *event)
+{
+  switch (event->type()) {
+    case QEvent::FontChange:
+      impl->metrics.clear();
+      break;
+    case QEvent::EnabledChange:
+    case QEvent::PaletteChange:
+      updatePens();
+      break;
+    default:
+      break;
+  }
+  QLineEdit::changeEvent(event);
+}
+
+void QTagEdit::connectNotify(const QMetaMethod &signal)
+{
+  if (signal == QMetaMethod::fromSignal(&QTagEdit::tagsDiff)) {
+    impl->tags.record_changes = true;
+  }
+  QLineEdit::connectNotify(signal);
+}
+
+void QTagEdit::disconnectNotify(const QMetaMethod &signal)
+{
+  // Disconnecting everything at once passes an invalid signal
+  const auto tags_diff = QMetaMethod::fromSignal(&QTagEdit::tagsDiff);
+  if (!signal.isValid() || signal == tags_diff) {
+    impl->tags.record_changes = isSignalConnected(tags_diff);
+    if (!impl->tags.record_changes) {
+      impl->tags.added.clear();
+      impl->tags.removed.clear();
+    }
+  }
+  QLineEdit::disconnectNotify(signal);
+}
+
+void QTagEdit::emitTagsDiff()
+{
+  auto &model = impl->tags;
+  if (model.added.isEmpty() && model.removed.isEmpty()) {
+    return;
+  }
+  auto added = std::exchange(model.added, {});
+  auto removed = std::exchange(model.removed, {});
+
+  // Tags that were taken out and put back in by the same change, like tags
+  // moved elsewhere, are neither added nor removed
+  auto removed_counts = QHash<QString, int>{};
+  for (const auto &tag : removed) {
+    ++removed_counts[tag];
+  }
+  auto moved = QStringList{};
+  added.removeIf([&](const QString &tag) {
+    auto it = removed_counts.find(tag);
+    if (it == removed_counts.end() || *it == 0) {
+      return false;
+    }
+    --*it;
+    moved.append(tag);
+    return true;
+  });
+  removed.removeIf([&](const QString &tag) {
+    auto it = removed_counts.find(tag);
+    if (it == removed_counts.end() || *it == 0) {
+      return true;
+    }
+    --*it;
+    return false;
+  });
+  emit tagsDiff(added, removed, moved);
+}
+
+void QTagEdit::layoutTags(QRect rect)
+{
+  this->ensurePolished();
+
+  const auto font_metrics = fontMetrics();
   auto text_y =
-      static_cast<int>(rect.height() / 2.0 + fontMetrics().height() / 2.0);
-  auto text_rect = [&](const QString &str, int offset,
-                       QMargins margin) -> QRect {
-    auto rect = QRect{0, 0, fontMetrics().horizontalAdvance(str),
-                      fontMetrics().height()};
+      static_cast<int>(rect.height() / 2.0 + font_metrics.height() / 2.0);
+  auto text_rect = [&](int width, int offset, QMargins margin) -> QRect {
+    auto rect = QRect{0, 0, width, font_metrics.height()};
     rect.moveBottom(text_y);
     rect.moveLeft(offset);
     rect += margin;
     return rect;
   };
 
-  for (const auto &tag : getTags()) {
-    this->ensurePolished();
-
-    QString tag_only = tag;
-    QString property_only = "";
-    auto style = Filter(tag) ? impl->primary : impl->secondary;
-    if (impl->separator) {
-      auto first_sep = tag.indexOf(*impl->separator);
-      if (first_sep >= 0) {
-        tag_only.truncate(first_sep);
-        style = Filter(tag_only) ? impl->primary : impl->secondary;
-        property_only = tag.sliced(first_sep);
-      }
+  auto &layouts = impl->layouts;
+  layouts.clear();
+  layouts.reserve(impl->tags.size());
+  for (qsizetype i = 0; i < impl->tags.size(); ++i) {
+    const auto tag = impl->tags.tag(i);
+    const auto metrics = impl->metricsFor(tag, font_metrics);
+    const auto has_property = metrics.name_length < tag.size();
+    const auto name = has_property ? QString::fromRawData(tag.constData(),
+                                                          metrics.name_length)
+                                   : tag;
+
+    auto &layout = layouts.emplace_back();
+    layout.index = i;
+    layout.style_class =
+        Filter(name) ? Impl::kPrimaryStyle : Impl::kSecondaryStyle;
+    layout.has_property = has_property;
+    layout.text_rect = rect;
+    layout.shade_rect = text_rect(
+        metrics.width, rect.left(),
+        has_property ? Impl::kTagMarginsWithProperty : Impl::kTagMargins);
+    if (has_property) {
+      layout.property_rect =
+          text_rect(metrics.property_width, rect.left() + metrics.name_width,
+                    Impl::kPropertyMargins);
     }
-    if (!line_only && this->isEnabled()) {
-      auto has_property = !property_only.isEmpty();
-      auto margin =
-          has_property ? Impl::kTagMarginsWithProperty : Impl::kTagMargins;
-      QPainterPath path;
-      path.addRect(text_rect(tag, rect.left(), margin));
-      painter.fillPath(path, style.shade_color);
-
-      if (has_property) {
-        QPainterPath path;
-        const int offset =
-            rect.left() + fontMetrics().horizontalAdvance(tag_only);
-        path.addRect(text_rect(property_only, offset, Impl::kPropertyMargins));
-        painter.fillPath(path, style.property_color);
+    auto line_rect = text_rect(metrics.width, rect.left(), Impl::kTagMargins);
+    layout.underline = QLine{line_rect.bottomLeft(), line_rect.bottomRight()};
+
+    rect.moveLeft(rect.left() + metrics.advance);
+  }
+}
+
+void QTagEdit::renderTags(QStylePainter &painter, bool line_only)
+{
+  const auto enabled = this->isEnabled();
+  const auto with_shades = !line_only && enabled;
+
+  for (auto &batch : impl->batches) {
+    batch.shades.clear();
+    batch.properties.clear();
+    batch.underlines.clear();
+  }
+  for (const auto &layout : impl->layouts) {
+    auto &batch = impl->batches[layout.style_class];
+    if (with_shades) {
+      batch.shades.append(layout.shade_rect);
+      if (layout.has_property) {
+        batch.properties.append(layout.property_rect);
       }
     }
-    {
-      auto line_rect = text_rect(tag, rect.left(), Impl::kTagMargins);
-      if (this->isEnabled()) {
-        painter.setPen(QPen(style.line_color, Impl::kLineWidth));
-      } else {
-        painter.setPen(QPen(QColor("lightgray"), Impl::kLineWidth));
-      }
-      painter.drawLine(line_rect.bottomLeft(), line_rect.bottomRight());
+    batch.underlines.append(layout.underline);
+  }
+
+  // Property shades go on top of the tag shades, underlines on top of both
+  painter.setPen(Qt::NoPen);
+  if (with_shades) {
+    for (int i = 0; i < Impl::kStyleClassCount; ++i) {
+      const auto &style = impl->styleFor(static_cast<Impl::StyleClass>(i));
+      painter.setBrush(style.shade_color);
+      painter.drawRects(impl->batches[i].shades);
+    }
+    for (int i = 0; i < Impl::kStyleClassCount; ++i) {
+      const auto &style = impl->styleFor(static_cast<Impl::StyleClass>(i));
+      painter.setBrush(style.property_color);
+      painter.drawRects(impl->batches[i].properties);
+    }
+  }
+  painter.setBrush(Qt::NoBrush);
+  for (int i = 0; i < Impl::kStyleClassCount; ++i) {
+    painter.setPen(impl->pens[i].line);
+    painter.drawLines(impl->batches[i].underlines);
+  }
+
+  if (line_only) {
+    return;
+  }
+  // Text goes on top of all backgrounds, so glyphs overhanging into the next
+  // tag stay visible
+  for (const auto &layout : impl->layouts) {
+    painter.setPen(impl->pens[layout.style_class].text);
+    painter.drawText(layout.text_rect, Qt::AlignVCenter,
+                     impl->tags.tag(layout.index));
+  }
+}
+
+void QTagEdit::updatePens()
+{
+  for (int i = 0; i < Impl::kStyleClassCount; ++i) {
+    auto &pens = impl->pens[i];
+    if (this->isEnabled()) {
+      const auto &style = impl->styleFor(static_cast<Impl::StyleClass>(i));
+      pens.text = getPenForColor(style.property_color);
+      pens.line = QPen(style.line_color, Impl::kLineWidth);
+    } else {
+      pens.text = QPen(Impl::kDisabledTextColor);
+      pens.line = QPen(Impl::kDisabledLineColor, Impl::kLineWidth);
     }
-    rect.moveLeft(rect.left() + fontMetrics().horizontalAdvance(tag + " "));
   }
 }
 
@@ -367,18 +1481,46 @@ QPen QTagEdit::getPenForColor(const QColor &color)
 
 bool QTagEdit::Filter(const QString &tag)
 {
-  if (impl->tag_filter) {
-    return impl->tag_filter(tag);
+  const auto &valid_tags = impl->valid_tags;
+  if (valid_tags && impl->valid_tags_sensitivity == Qt::CaseSensitive) {
+    return valid_tags->contains(tag);
   }
-  return true;
+  if (!valid_tags && !impl->tag_filter) {
+    return true;
+  }
+  if (auto it = impl->filter_cache.constFind(tag);
+      it != impl->filter_cache.cend()) {
+    return *it;
+  }
+  if (impl->filter_cache.size() >= Impl::kMaxCachedFilterResults) {
+    impl->filter_cache.clear();
+  }
+  // The tag may be raw data pointing into the text, so store a deep copy
+  const auto key = QString{tag.constData(), tag.size()};
+  const auto result = impl->matchesFilter(key);
+  impl->filter_cache.insert(key, result);
+  return result;
 }
 
 void QTagEdit::makeTagsUnique()
 {
-  if (!impl->unique_tags) {
-    return;
+  switch (impl->uniqueness) {
+    case Uniqueness::kNone:
+      return;
+    case Uniqueness::kSorted:
+      makeTagsUniqueSorted();
+      return;
+    case Uniqueness::kOrdered:
+      makeTagsUniqueOrdered();
+      return;
   }
-  if (impl->separator) {
+}
+
+void QTagEdit::makeTagsUniqueSorted()
+{
+  if (impl->mergesProperties()) {
+    mergeProperties(true);
+  } else if (impl->separator) {
     auto properties = getProperties();
     std::sort(
         properties.begin(), properties.end(),
@@ -398,3 +1540,83 @@ void QTagEdit::makeTagsUnique()
     setTags(tags);
   }
 }
+
+void QTagEdit::makeTagsUniqueOrdered()
+{
+  const auto &model = impl->tags;
+  // The model keeps track of duplicates, so there usually is nothing to do
+  if (model.duplicates == 0) {
+    return;
+  }
+  if (impl->mergesProperties()) {
+    mergeProperties(false);
+    return;
+  }
+  // Keep the first occurrence of every tag, the views point into the text
+  // which stays untouched until the new one is set
+  auto seen = QSet<QStringView>{};
+  seen.reserve(model.size());
+  auto text = QString{};
+  text.reserve(model.text.size());
+  for (const auto &span : model.spans) {
+    const auto key = model.key(span);
+    if (!seen.contains(key)) {
+      seen.insert(key);
+      Impl::appendTag(text,
+                      QStringView{model.text}.sliced(span.offset, span.length));
+    }
+  }
+  commitText(text);
+}
+
+void QTagEdit::mergeProperties(bool sort)
+{
+  const auto &model = impl->tags;
+  const auto separator = *impl->separator;
+  const auto unique_values =
+      impl->property_merge == PropertyMerge::kMergeUniqueValues;
+
+  // Properties are grouped by name in order of their first occurrence, the
+  // views point into the text which stays untouched until the new one is set
+  struct Group {
+    QStringView name;
+    QList<QStringView> values;
+    QSet<QStringView> seen_values;
+  };
+  auto groups = std::vector<Group>{};
+  auto group_index = QHash<QStringView, std::size_t>{};
+  group_index.reserve(model.size());
+  for (qsizetype i = 0; i < model.size(); ++i) {
+    const auto property = propertyView(i);
+    auto it = group_index.find(property.name);
+    if (it == group_index.end()) {
+      it = group_index.insert(property.name, groups.size());
+      groups.push_back({.name = property.name});
+    }
+    auto &group = groups[*it];
+    property.forEachValue([&](QStringView value) {
+      if (unique_values) {
+        if (group.seen_values.contains(value)) {
+          return;
+        }
+        group.seen_values.insert(value);
+      }
+      group.values.append(value);
+    });
+  }
+  if (sort) {
+    std::sort(groups.begin(), groups.end(),
+              [](const Group &a, const Group &b) { return a.name < b.name; });
+  }
+
+  auto text = QString{};
+  text.reserve(model.text.size());
+  for (const auto &group : groups) {
+    Impl::appendTag(text, group.name);
+    for (const auto &value : group.values) {
+      text += separator;
+      text += value;
+    }
+  }
+  commitText(text);
+}
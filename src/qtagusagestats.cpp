@@ -0,0 +1,154 @@
+// QTagEdit
+// Copyright (C) 2024  Julian Gottwald
+//
+// This library is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License Version 3 as
+// published by the Free Software Foundation.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this library.  If not, see <https://www.gnu.org/licenses/>.
+#include "qtagusagestats.hpp"
+
+#include <QDataStream>
+#include <QDateTime>
+#include <QFile>
+#include <QMap>
+#include <QSaveFile>
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <queue>
+#include <utility>
+#include <vector>
+
+struct QTagUsageStats::Impl {
+  static constexpr quint32 kMagic{0x51544753};  // "QTGS"
+  static constexpr quint16 kVersion{1};
+
+  struct Entry {
+    QString tag{};
+    double score{0};
+    // Seconds since epoch
+    qint64 updated{0};
+  };
+
+  double half_life{};
+  // Keyed on the case folded tag, so that a prefix is a contiguous range
+  QMap<QString, Entry> entries{};
+
+  double decayed(const Entry &entry, qint64 now) const
+  {
+    return entry.score * std::exp2(-(now - entry.updated) / half_life);
+  }
+};
+
+QTagUsageStats::QTagUsageStats(std::chrono::seconds half_life)
+    : impl{std::make_unique<Impl>()}
+{
+  impl->half_life = static_cast<double>(std::max<qint64>(half_life.count(), 1));
+}
+
+QTagUsageStats::~QTagUsageStats() = default;
+
+void QTagUsageStats::record(const QString &tag)
+{
+  if (tag.isEmpty()) {
+    return;
+  }
+  const auto now = QDateTime::currentSecsSinceEpoch();
+  auto &entry = impl->entries[tag.toCaseFolded()];
+  entry.score = entry.tag.isEmpty() ? 1.0 : impl->decayed(entry, now) + 1.0;
+  entry.tag = tag;
+  entry.updated = now;
+}
+
+double QTagUsageStats::score(const QString &tag) const
+{
+  auto it = impl->entries.constFind(tag.toCaseFolded());
+  if (it == impl->entries.cend()) {
+    return 0;
+  }
+  return impl->decayed(*it, QDateTime::currentSecsSinceEpoch());
+}
+
+QStringList QTagUsageStats::top(const QString &prefix, int limit) const
+{
+  if (limit <= 0) {
+    return {};
+  }
+  const auto now = QDateTime::currentSecsSinceEpoch();
+  const auto folded = prefix.toCaseFolded();
+
+  // Bounded min-heap, the worst of the best candidates so far is on top
+  using Candidate = std::pair<double, const QString *>;
+  auto heap = std::priority_queue<Candidate, std::vector<Candidate>,
+                                  std::greater<Candidate>>{};
+  const auto &entries = impl->entries;
+  for (auto it = entries.lowerBound(folded);
+       it != entries.cend() && it.key().startsWith(folded); ++it) {
+    const auto score = impl->decayed(*it, now);
+    if (static_cast<int>(heap.size()) < limit) {
+      heap.emplace(score, &it->tag);
+    } else if (score > heap.top().first) {
+      heap.pop();
+      heap.emplace(score, &it->tag);
+    }
+  }
+
+  auto result = QStringList{};
+  result.resize(static_cast<qsizetype>(heap.size()));
+  for (auto i = result.size() - 1; i >= 0; --i) {
+    result[i] = *heap.top().second;
+    heap.pop();
+  }
+  return result;
+}
+
+bool QTagUsageStats::load(const QString &path)
+{
+  QFile file(path);
+  if (!file.open(QIODevice::ReadOnly)) {
+    return false;
+  }
+  QDataStream stream(&file);
+  quint32 magic{};
+  quint16 version{};
+  quint32 count{};
+  stream >> magic >> version >> count;
+  if (magic != Impl::kMagic || version != Impl::kVersion) {
+    return false;
+  }
+
+  auto entries = QMap<QString, Impl::Entry>{};
+  for (quint32 i = 0; i < count && stream.status() == QDataStream::Ok; ++i) {
+    auto entry = Impl::Entry{};
+    stream >> entry.tag >> entry.score >> entry.updated;
+    // Stored in key order, so every insert goes to the end
+    entries.insert(entries.cend(), entry.tag.toCaseFolded(), entry);
+  }
+  if (stream.status() != QDataStream::Ok) {
+    return false;
+  }
+  impl->entries = std::move(entries);
+  return true;
+}
+
+bool QTagUsageStats::save(const QString &path) const
+{
+  QSaveFile file(path);
+  if (!file.open(QIODevice::WriteOnly)) {
+    return false;
+  }
+  QDataStream stream(&file);
+  stream << Impl::kMagic << Impl::kVersion
+         << static_cast<quint32>(impl->entries.size());
+  for (const auto &entry : impl->entries) {
+    stream << entry.tag << entry.score << entry.updated;
+  }
+  return stream.status() == QDataStream::Ok && file.commit();
+}
@@ -0,0 +1,46 @@
+#include <QCoreApplication>
+#include <QFile>
+#include <QStringList>
+#include <QTextStream>
+
+#include "qtagcompletionindex.hpp"
+#include "qtagcompletionprovider.hpp"
+
+// Builds an index file for QTagMappedCompletionProvider from a newline
+// delimited UTF-8 list of tags, in any order.
+//
+// Usage: qtagindex <tags.txt> <tags.index>
+int main(int argc, char* argv[])
+{
+  QCoreApplication app(argc, argv);
+  const auto arguments = app.arguments();
+  QTextStream err(stderr);
+  if (arguments.size() != 3) {
+    err << "Usage: qtagindex <tags.txt> <tags.index>\n";
+    return 2;
+  }
+
+  QFile input(arguments[1]);
+  if (!input.open(QIODevice::ReadOnly | QIODevice::Text)) {
+    err << "Could not open " << arguments[1] << "\n";
+    return 1;
+  }
+  auto tags = QStringList{};
+  QTextStream stream(&input);
+  QString line;
+  while (stream.readLineInto(&line)) {
+    line = line.trimmed();
+    // Null bytes separate keys and tags in the index
+    if (!line.isEmpty() && !line.contains(QChar::Null)) {
+      tags.append(line);
+    }
+  }
+
+  const auto index = QTagCompletionIndex{tags};
+  if (!QTagMappedCompletionProvider::writeIndex(index, arguments[2])) {
+    err << "Could not write " << arguments[2] << "\n";
+    return 1;
+  }
+  QTextStream(stdout) << "Indexed " << index.size() << " tags\n";
+  return 0;
+}